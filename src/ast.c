@@ -1,6 +1,7 @@
 
 #include "ast.h"
 #include "utils.h"
+#include <inttypes.h>
 #include <stdio.h>
 
 #define PARSER(NAME, args...)                                                  \
@@ -27,7 +28,20 @@
     }                                                                          \
   }
 
+// lex the token after the consumed ones, in place of the last of them
+static void parser_fill(parser_t *parser) {
+  token_t tok = tokenreader_next(parser->reader);
+  if (tok.kind != T_INCOMPLETE) {
+    parser->tokens[0] = tok;
+    parser->len = 1;
+    parser->pos = 0;
+  }
+}
+
 static inline token_t parser_peek(parser_t *parser) {
+  if (parser->pos == parser->len && parser->reader != NULL) {
+    parser_fill(parser);
+  }
   if (parser->pos < parser->len) {
     token_t res = parser->tokens[parser->pos];
     return res;
@@ -37,6 +51,9 @@ static inline token_t parser_peek(parser_t *parser) {
 }
 
 static inline token_t parser_next(parser_t *parser) {
+  if (parser->pos == parser->len && parser->reader != NULL) {
+    parser_fill(parser);
+  }
   if (parser->pos < parser->len) {
     token_t res = parser->tokens[parser->pos];
     parser->pos += 1;
@@ -48,19 +65,33 @@ static inline token_t parser_next(parser_t *parser) {
 
 parser_t parser_new(tokenbuf_t tokens) {
   if (tokens.len == 0) {
-    return (parser_t){.tokens = NULL, .len = 0, .pos = 0};
+    return (parser_t){.tokens = NULL, .len = 0, .pos = 0, .reader = NULL};
   } else {
     token_t *buf = gcrealloc(tokens.tokens, tokens.len * sizeof(token_t));
-    return (parser_t){.tokens = buf, .len = tokens.len, .pos = 0};
+    return (parser_t){
+        .tokens = buf, .len = tokens.len, .pos = 0, .reader = NULL};
   }
 }
 
+parser_t parser_stream(tokenreader_t *reader) {
+  // the parser looks a single token ahead
+  token_t *buf = gcalloc(sizeof(token_t));
+  return (parser_t){.tokens = buf, .len = 0, .pos = 0, .reader = reader};
+}
+
+bool parser_done(parser_t *parser) {
+  return parser_peek(parser).kind == T_INCOMPLETE;
+}
+
 PARSER(atom) {
   token_t next = PEEK();
   switch (next.kind) {
   case T_NUM:
     NEXT();
     return (expr_t){.kind = E_NUM, .num = next.num};
+  case T_INT:
+    NEXT();
+    return (expr_t){.kind = E_INT, .integer = next.integer};
   case T_STR:
     NEXT();
     return (expr_t){.kind = E_STR, .str = next.str};
@@ -101,23 +132,45 @@ PARSER(funcall) {
   if (callee.kind == E_NOMATCH) {
     return ERROR("invalid callee expression");
   }
+  expr_t *args = NULL;
+  usize nargs = 0;
+  usize cap = 0;
   loop {
     expr_t param = CALL(atom);
     ASSERT(param, STR("invalid param expression"));
     if (param.kind == E_NOMATCH) {
-      return callee;
-    } else {
-      expr_t *f = gcalloc(sizeof(expr_t));
-      expr_t *x = gcalloc(sizeof(expr_t));
-      *f = callee;
-      *x = param;
-      callee =
-          (expr_t){.kind = E_CALL, .call = (ecall_t){.callee = f, .param = x}};
+      break;
+    }
+    if (nargs >= cap) {
+      cap = (cap == 0) ? 2 : (cap * 2);
+      args = gcrealloc(args, cap * sizeof(expr_t));
     }
+    args[nargs] = param;
+    nargs += 1;
+  }
+  if (nargs == 0) {
+    return callee;
   }
+  expr_t *f = gcalloc(sizeof(expr_t));
+  *f = callee;
+  args = gcrealloc(args, nargs * sizeof(expr_t));
+  return (expr_t){.kind = E_CALL,
+                  .call = (ecall_t){.callee = f, .nargs = nargs, .args = args}};
 }
 END_PARSER()
 
+// make a function expression taking all the parameters at once
+static expr_t make_fun(tokenbuf_t params, expr_t body) {
+  str_t *p = gcalloc(params.len * sizeof(str_t));
+  for (usize i = 0; i < params.len; ++i) {
+    p[i] = params.tokens[i].ident;
+  }
+  expr_t *b = gcalloc(sizeof(expr_t));
+  *b = body;
+  return (expr_t){.kind = E_FUN,
+                  .fun = (efun_t){.arity = params.len, .params = p, .body = b}};
+}
+
 PARSER(unary) {
   token_t sign = PEEK();
   if (sign.kind == T_MINUS) {
@@ -231,8 +284,11 @@ PARSER(fun) {
   } else {
     NEXT();
   }
-  token_t param = NEXT();
-  if (param.kind != T_IDENT) {
+  tokenbuf_t params = tokenbuf_new();
+  while (PEEK().kind == T_IDENT) {
+    tokenbuf_push(&params, NEXT());
+  }
+  if (params.len == 0) {
     return ERROR("expected param identifier");
   }
   if (NEXT().kind != T_ARROW) {
@@ -241,10 +297,7 @@ PARSER(fun) {
   expr_t body = CALL(expr);
   ASSERT(body, STR("invalid function body"));
 
-  expr_t *b = gcalloc(sizeof(expr_t));
-  *b = body;
-  return (expr_t){.kind = E_FUN,
-                  .fun = (efun_t){.param = param.ident, .body = b}};
+  return make_fun(params, body);
 }
 END_PARSER()
 
@@ -254,6 +307,10 @@ PARSER(binding) {
   } else {
     NEXT();
   }
+  bool memo = (PEEK().kind == T_MEMO);
+  if (memo) {
+    NEXT();
+  }
   bool rec = (PEEK().kind == T_REC);
   if (rec) {
     NEXT();
@@ -277,12 +334,14 @@ PARSER(binding) {
   expr_t body = CALL(expr);
   ASSERT(body, STR("invalid binding body expression"));
 
-  for (usize j = 0; j < params.len; ++j) {
-    usize i = params.len - 1 - j;
-    expr_t *v = gcalloc(sizeof(expr_t));
-    *v = value;
-    str_t p = params.tokens[i].ident;
-    value = (expr_t){.kind = E_FUN, .fun = (efun_t){.param = p, .body = v}};
+  if (params.len > 0) {
+    value = make_fun(params, value);
+  }
+  if (memo) {
+    if (value.kind != E_FUN) {
+      return ERROR("memo binding must be a function");
+    }
+    value.fun.memo = true;
   }
 
   expr_t *v = gcalloc(sizeof(expr_t));
@@ -341,6 +400,10 @@ toplevel_t toplevel(parser_t *__parser) {
   } else {
     NEXT();
   }
+  bool memo = (PEEK().kind == T_MEMO);
+  if (memo) {
+    NEXT();
+  }
   bool rec = (PEEK().kind == T_REC);
   if (rec) {
     NEXT();
@@ -364,12 +427,14 @@ toplevel_t toplevel(parser_t *__parser) {
   expr_t value = CALL(expr);
   ASSERT(value, STR("invalid binding value expression"));
 
-  for (usize j = 0; j < params.len; ++j) {
-    usize i = params.len - 1 - j;
-    expr_t *v = gcalloc(sizeof(expr_t));
-    *v = value;
-    str_t p = params.tokens[i].ident;
-    value = (expr_t){.kind = E_FUN, .fun = (efun_t){.param = p, .body = v}};
+  if (params.len > 0) {
+    value = make_fun(params, value);
+  }
+  if (memo) {
+    if (value.kind != E_FUN) {
+      return ERROR("memo binding must be a function");
+    }
+    value.fun.memo = true;
   }
 
   if (PEEK().kind == T_IN) {
@@ -410,6 +475,9 @@ static void _fprint_expr(FILE *f, expr_t *e, usize level) {
   case E_NUM:
     fprintf(f, "%.*g", 16, e->num);
     break;
+  case E_INT:
+    fprintf(f, "%" PRId64, e->integer);
+    break;
   case E_STR:
     fdebug_str(f, e->str.data, e->str.len);
     break;
@@ -427,11 +495,15 @@ static void _fprint_expr(FILE *f, expr_t *e, usize level) {
     fprintf(f, "%.*s", (int)(e->var.name.len), e->var.name.data);
     break;
   case E_CALL:
+  case E_CALL_FUN:
     fprintf(f, "(");
     _fprint_expr(f, e->call.callee, level);
-    fprintf(f, ") (");
-    _fprint_expr(f, e->call.param, level);
     fprintf(f, ")");
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      fprintf(f, " (");
+      _fprint_expr(f, &e->call.args[i], level);
+      fprintf(f, ")");
+    }
     break;
   case E_LET:
   case E_LETREC:
@@ -455,7 +527,15 @@ static void _fprint_expr(FILE *f, expr_t *e, usize level) {
     _fprint_expr(f, e->let.body, level + 1);
     break;
   case E_FUN:
-    fprintf(f, "fun %.*s ->\n", (int)(e->fun.param.len), e->fun.param.data);
+    if (e->fun.memo) {
+      fprintf(f, "memo ");
+    }
+    fprintf(f, "fun");
+    for (usize i = 0; i < e->fun.arity; ++i) {
+      str_t param = e->fun.params[i];
+      fprintf(f, " %.*s", (int)(param.len), param.data);
+    }
+    fprintf(f, " ->\n");
     for (usize i = 0; i <= level; ++i) {
       fprintf(f, "  ");
     }
@@ -488,22 +568,42 @@ static void _fprint_expr(FILE *f, expr_t *e, usize level) {
   case E_SUB:
   case E_MUL:
   case E_DIV:
-  case E_EQ: {
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR: {
     const char *op = "";
     switch (e->kind) {
     case E_ADD:
+    case E_ADD_NUM:
+    case E_ADD_INT:
+    case E_ADD_STR:
       op = "+";
       break;
     case E_SUB:
+    case E_SUB_NUM:
+    case E_SUB_INT:
       op = "-";
       break;
     case E_MUL:
+    case E_MUL_NUM:
+    case E_MUL_INT:
       op = "*";
       break;
     case E_DIV:
       op = "/";
       break;
     case E_EQ:
+    case E_EQ_NUM:
+    case E_EQ_INT:
+    case E_EQ_STR:
       op = "==";
       break;
     default:
@@ -5,6 +5,9 @@
 struct expr;
 typedef struct expr expr_t;
 
+struct chunk;
+struct native;
+
 typedef struct error_chain {
   str_t msg;
   struct error_chain *next;
@@ -14,6 +17,7 @@ typedef enum exprkind {
   E_NOMATCH = -2,
   E_ERROR = -1,
   E_NUM,
+  E_INT,
   E_STR,
   E_BOOL,
   E_UNIT,
@@ -29,27 +33,79 @@ typedef enum exprkind {
   E_MUL,
   E_DIV,
   E_EQ,
+  // specialized variants of the nodes above, rewritten in place by the tree
+  // walker once it has seen the types of their operands
+  E_CALL_FUN,
+  E_ADD_NUM,
+  E_SUB_NUM,
+  E_MUL_NUM,
+  E_EQ_NUM,
+  E_ADD_INT,
+  E_SUB_INT,
+  E_MUL_INT,
+  E_EQ_INT,
+  // variants rewritten by the type checker, for operands proven to be strings:
+  // they need no type checks
+  E_ADD_STR,
+  E_EQ_STR,
 } exprkind_t;
 
+typedef enum varscope {
+  VAR_UNBOUND,
+  // binding of the current frame
+  VAR_LOCAL,
+  // value copied into the closure of the current function
+  VAR_CAPTURED,
+  // binding of a toplevel, in the table of globals
+  VAR_GLOBAL,
+} varscope_t;
+
 typedef struct evar {
   str_t name;
+  // lexical address, filled in by the resolver: the index of the binding in
+  // the current frame, in the captures of the closure, or in the globals
+  varscope_t scope;
+  usize slot;
 } evar_t;
 
+typedef struct efun efun_t;
+
 typedef struct ecall {
   expr_t *callee;
-  expr_t *param;
+  usize nargs;
+  expr_t *args;
+  // function last called by a specialized saturated call, and number of times
+  // the node went back to a generic call
+  efun_t *cache;
+  u8 deopts;
 } ecall_t;
 
 typedef struct elet {
   str_t name;
+  usize slot;
   expr_t *expr;
   expr_t *body;
 } elet_t;
 
-typedef struct efun {
-  str_t param;
+struct efun {
+  usize arity;
+  str_t *params;
+  // number of slots in the frame of a call: the parameters are in the first
+  // slots, and every let binding of the body gets its own slot after them
+  usize frame_size;
+  // free variables of the body, as addresses in the frame where the function
+  // is created. They are copied into the closure at creation.
+  usize ncaptures;
+  evar_t *captures;
   expr_t *body;
-} efun_t;
+  // whether results are cached by argument values, for `let memo` bindings
+  bool memo;
+  // bytecode of the body, when compiled for the vm
+  struct chunk *chunk;
+  // native code of the body, published by the jit once compiled, as threads
+  // may be calling the function
+  _Atomic(struct native *) native;
+};
 
 typedef struct eif {
   expr_t *cond;
@@ -64,6 +120,8 @@ typedef struct eunop {
 typedef struct ebinop {
   expr_t *lhs;
   expr_t *rhs;
+  // number of times a specialized node went back to the generic operation
+  u8 deopts;
 } ebinop_t;
 
 struct expr {
@@ -71,7 +129,12 @@ struct expr {
   union {
     error_chain_t error;
     f64 num;
-    str_t str;
+    i64 integer;
+    // string literals are laid out like string values, which point to them
+    struct {
+      str_t str;
+      u64 str_hash;
+    };
     bool boolean;
     evar_t var;
     ecall_t call;
@@ -92,11 +155,16 @@ typedef enum toplevelkind {
 
 typedef struct toplevel_let {
   str_t name;
+  // slot of the binding in the table of globals
+  usize global;
   expr_t expr;
 } toplevel_let_t;
 
 typedef struct toplevel {
   toplevelkind_t kind;
+  // size of the frame the toplevel is evaluated in, for the let bindings of its
+  // expression
+  usize frame_size;
   union {
     error_chain_t error;
     toplevel_let_t let;
@@ -108,9 +176,15 @@ typedef struct parser {
   token_t *tokens;
   usize len;
   usize pos;
+  // reader lexing the tokens on demand, which are then only buffered until
+  // they are consumed, or NULL
+  tokenreader_t *reader;
 } parser_t;
 
 parser_t parser_new(tokenbuf_t tokens);
+parser_t parser_stream(tokenreader_t *reader);
+// whether all the tokens were consumed, reading more input if needed
+bool parser_done(parser_t *parser);
 expr_t expr(parser_t *parser);
 toplevel_t toplevel(parser_t *toplevel);
 
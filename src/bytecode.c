@@ -0,0 +1,264 @@
+#include "ast.h"
+#include "bytecode.h"
+#include "eval.h"
+#include "utils.h"
+
+typedef struct compiler {
+  chunk_t *chunk;
+  // number of temporaries on the stack at the current instruction
+  usize depth;
+} compiler_t;
+
+static chunk_t *chunk_new(usize frame_size) {
+  chunk_t *chunk = gcalloc(sizeof(chunk_t));
+  chunk->code = NULL;
+  chunk->len = 0;
+  chunk->cap = 0;
+  chunk->consts = NULL;
+  chunk->nconsts = 0;
+  chunk->consts_cap = 0;
+  chunk->funs = NULL;
+  chunk->nfuns = 0;
+  chunk->funs_cap = 0;
+  chunk->frame_size = frame_size;
+  chunk->max_stack = 0;
+  return chunk;
+}
+
+// append a word to the chunk, returning its offset
+static usize emit(compiler_t *c, u32 word) {
+  chunk_t *chunk = c->chunk;
+  if (chunk->len >= chunk->cap) {
+    usize new_cap = (chunk->cap == 0) ? 16 : (chunk->cap * 2);
+    chunk->code = gcrealloc_atomic(chunk->code, new_cap * sizeof(u32));
+    chunk->cap = new_cap;
+  }
+  chunk->code[chunk->len] = word;
+  chunk->len += 1;
+  return chunk->len - 1;
+}
+
+// emit an opcode, along with its effect on the number of temporaries
+static void emit_op(compiler_t *c, opcode_t op, i32 effect) {
+  emit(c, (u32)op);
+  c->depth = (usize)((isize)c->depth + effect);
+  if (c->depth > c->chunk->max_stack) {
+    c->chunk->max_stack = c->depth;
+  }
+}
+
+static u32 operand(usize x) {
+  if (x > UINT32_MAX) {
+    panic("bytecode operand out of range");
+  }
+  return (u32)x;
+}
+
+static void emit_const(compiler_t *c, value_t value) {
+  chunk_t *chunk = c->chunk;
+  if (chunk->nconsts >= chunk->consts_cap) {
+    usize new_cap = (chunk->consts_cap == 0) ? 4 : (chunk->consts_cap * 2);
+    chunk->consts = gcrealloc(chunk->consts, new_cap * sizeof(value_t));
+    chunk->consts_cap = new_cap;
+  }
+  chunk->consts[chunk->nconsts] = value;
+  chunk->nconsts += 1;
+  emit_op(c, OP_CONST, 1);
+  emit(c, operand(chunk->nconsts - 1));
+}
+
+static void emit_fun(compiler_t *c, efun_t *fun) {
+  chunk_t *chunk = c->chunk;
+  if (chunk->nfuns >= chunk->funs_cap) {
+    usize new_cap = (chunk->funs_cap == 0) ? 4 : (chunk->funs_cap * 2);
+    chunk->funs = gcrealloc(chunk->funs, new_cap * sizeof(efun_t *));
+    chunk->funs_cap = new_cap;
+  }
+  chunk->funs[chunk->nfuns] = fun;
+  chunk->nfuns += 1;
+  emit_op(c, OP_FUN, 1);
+  emit(c, operand(chunk->nfuns - 1));
+}
+
+// patch the target of a jump to the current offset
+static void patch_jump(compiler_t *c, usize at) {
+  c->chunk->code[at] = operand(c->chunk->len);
+}
+
+static void compile_fun(efun_t *fun);
+
+// compile an expression. In tail position, the code returns from the function
+// instead of leaving the value on the stack.
+static void compile_expr(compiler_t *c, expr_t *e, bool tail) {
+  switch (e->kind) {
+  case E_NUM:
+    emit_const(c, value_num(e->num));
+    break;
+  case E_INT:
+    emit_const(c, value_int(e->integer));
+    break;
+  case E_STR:
+    emit_const(c, value_str(&e->str));
+    break;
+  case E_BOOL:
+    emit_const(c, value_bool(e->boolean));
+    break;
+  case E_UNIT:
+    emit_const(c, UNIT);
+    break;
+  case E_VAR:
+    switch (e->var.scope) {
+    case VAR_LOCAL:
+      emit_op(c, OP_LOCAL, 1);
+      emit(c, operand(e->var.slot));
+      break;
+    case VAR_CAPTURED:
+      emit_op(c, OP_CAPTURED, 1);
+      emit(c, operand(e->var.slot));
+      break;
+    case VAR_GLOBAL:
+      emit_op(c, OP_GLOBAL, 1);
+      emit(c, operand(e->var.slot));
+      break;
+    case VAR_UNBOUND:
+      emit_op(c, OP_UNBOUND, 1);
+      break;
+    }
+    break;
+  case E_CALL:
+  case E_CALL_FUN:
+    compile_expr(c, e->call.callee, false);
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      compile_expr(c, &e->call.args[i], false);
+    }
+    if (tail) {
+      emit_op(c, OP_TAILCALL, -(i32)e->call.nargs);
+      emit(c, operand(e->call.nargs));
+      return;
+    }
+    emit_op(c, OP_CALL, -(i32)e->call.nargs);
+    emit(c, operand(e->call.nargs));
+    break;
+  case E_LET:
+    compile_expr(c, e->let.expr, false);
+    emit_op(c, OP_STORE, -1);
+    emit(c, operand(e->let.slot));
+    compile_expr(c, e->let.body, tail);
+    return;
+  case E_LETREC:
+    compile_expr(c, e->let.expr, false);
+    emit_op(c, OP_LETREC, -1);
+    emit(c, operand(e->let.slot));
+    if (is_local_closure(e->let.expr)) {
+      emit_op(c, OP_TIE, 0);
+      emit(c, operand(e->let.slot));
+    }
+    compile_expr(c, e->let.body, tail);
+    return;
+  case E_FUN:
+    compile_fun(&e->fun);
+    emit_fun(c, &e->fun);
+    break;
+  case E_IFTHEN: {
+    compile_expr(c, e->ifthen.cond, false);
+    emit_op(c, OP_BRANCH, -1);
+    usize to_else = emit(c, 0);
+    usize depth = c->depth;
+    compile_expr(c, e->ifthen.then_body, tail);
+    usize to_end = 0;
+    if (!tail) {
+      emit_op(c, OP_JUMP, 0);
+      to_end = emit(c, 0);
+    }
+    patch_jump(c, to_else);
+    c->depth = depth;
+    compile_expr(c, e->ifthen.else_body, tail);
+    if (!tail) {
+      patch_jump(c, to_end);
+    }
+    return;
+  }
+  case E_NEG:
+    compile_expr(c, e->unop.rhs, false);
+    emit_op(c, OP_NEG, 0);
+    break;
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR: {
+    compile_expr(c, e->binop.lhs, false);
+    compile_expr(c, e->binop.rhs, false);
+    opcode_t op = OP_EQ;
+    switch (e->kind) {
+    case E_ADD:
+    case E_ADD_NUM:
+    case E_ADD_INT:
+    case E_ADD_STR:
+      op = OP_ADD;
+      break;
+    case E_SUB:
+    case E_SUB_NUM:
+    case E_SUB_INT:
+      op = OP_SUB;
+      break;
+    case E_MUL:
+    case E_MUL_NUM:
+    case E_MUL_INT:
+      op = OP_MUL;
+      break;
+    case E_DIV:
+      op = OP_DIV;
+      break;
+    default:
+      break;
+    }
+    emit_op(c, op, -1);
+    break;
+  }
+  case E_ERROR:
+  case E_NOMATCH:
+    emit_op(c, OP_INVALID, 1);
+    break;
+  }
+  if (tail) {
+    emit_op(c, OP_RETURN, -1);
+  }
+}
+
+static void compile_fun(efun_t *fun) {
+  if (fun->chunk != NULL) {
+    return;
+  }
+  compiler_t c = {.chunk = chunk_new(fun->frame_size), .depth = 0};
+  compile_expr(&c, fun->body, true);
+  fun->chunk = c.chunk;
+}
+
+chunk_t *compile_toplevel(toplevel_t *tl) {
+  compiler_t c = {.chunk = chunk_new(tl->frame_size), .depth = 0};
+  switch (tl->kind) {
+  case TL_EXPR:
+    compile_expr(&c, &tl->expr, false);
+    break;
+  case TL_LET:
+  case TL_LETREC:
+    compile_expr(&c, &tl->let.expr, false);
+    break;
+  case TL_ERROR:
+    emit_op(&c, OP_INVALID, 1);
+    break;
+  }
+  emit_op(&c, OP_HALT, 0);
+  return c.chunk;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ast.h"
+#include "eval.h"
+#include "utils.h"
+
+// instructions are encoded as a sequence of 32-bit words: the opcode, followed
+// by its operands
+typedef enum opcode {
+  // idx: push a constant
+  OP_CONST,
+  // slot: push a binding of the current frame
+  OP_LOCAL,
+  // slot: push a value captured by the current closure
+  OP_CAPTURED,
+  // slot: push a global binding
+  OP_GLOBAL,
+  // idx: create a closure for a function of the chunk
+  OP_FUN,
+  // slot: pop a value into the current frame
+  OP_STORE,
+  // slot: pop a value into the current frame, checking that it is a function
+  OP_LETREC,
+  // slot: patch the closure in a slot of the current frame so it refers to
+  // itself
+  OP_TIE,
+  // nargs: call the function below the arguments on top of the stack
+  OP_CALL,
+  // nargs: call, replacing the current frame
+  OP_TAILCALL,
+  OP_RETURN,
+  // target: jump to an absolute offset in the chunk
+  OP_JUMP,
+  // target: pop a boolean, jump if it is false
+  OP_BRANCH,
+  OP_NEG,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_EQ,
+  // push an unknown binding error
+  OP_UNBOUND,
+  // push an invalid expression error
+  OP_INVALID,
+  // end of a toplevel: return the top of the stack
+  OP_HALT,
+} opcode_t;
+
+typedef struct chunk {
+  u32 *code;
+  usize len;
+  usize cap;
+  value_t *consts;
+  usize nconsts;
+  usize consts_cap;
+  efun_t **funs;
+  usize nfuns;
+  usize funs_cap;
+  // number of local slots, and maximum number of temporaries above them
+  usize frame_size;
+  usize max_stack;
+} chunk_t;
+
+// compile a resolved toplevel, and all the functions it contains
+chunk_t *compile_toplevel(toplevel_t *tl);
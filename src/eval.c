@@ -1,13 +1,19 @@
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <threads.h>
 
 #include "eval.h"
+#include "hashmap.h"
+#include "jit.h"
+#include "memo.h"
 #include "utils.h"
 
-#define ERROR(__msg) ((value_t){.kind = V_ERROR, .error = STR(__msg)})
+#define ERROR(__msg) make_error(STR(__msg))
 #define BUBBLE(__x)                                                            \
   {                                                                            \
-    if (__x.kind == V_ERROR) {                                                 \
+    if (is_error(__x)) {                                                       \
       return __x;                                                              \
     }                                                                          \
   }
@@ -15,38 +21,721 @@
   value_t __bind = eval_expr(__args);                                          \
   BUBBLE(__bind);
 
-value_t *find_env(env_t env, str_t name) {
-  while (env != NULL && !str_comp(env->name, name)) {
-    env = env->next;
+// Quickening: generic nodes rewrite themselves in place into a variant
+// specialized for the operands they see. A specialized node whose guard fails
+// goes back to the generic node, which stops specializing after a few tries.
+// Threads evaluating toplevels in parallel share the nodes, so nodes are not
+// rewritten once frames are allocated on the heap.
+#define QUICKEN_LIMIT 4
+
+#define QUICKEN(__node, __kind)                                                \
+  {                                                                            \
+    if (!heap_frames && (__node).deopts < QUICKEN_LIMIT) {                     \
+      expr->kind = __kind;                                                     \
+    }                                                                          \
+  }
+#define DEOPTIMIZE(__node, __kind)                                             \
+  {                                                                            \
+    expr->kind = __kind;                                                       \
+    (__node).deopts += 1;                                                      \
+  }
+
+value_t *globals = NULL;
+static usize globals_cap = 0;
+
+void globals_reserve(usize len) {
+  if (len <= globals_cap) {
+    return;
   }
-  if (env == NULL) {
+  usize new_cap = (globals_cap == 0) ? 64 : globals_cap;
+  while (new_cap < len) {
+    new_cap *= 2;
+  }
+  globals = gcrealloc(globals, new_cap * sizeof(value_t));
+  for (usize i = globals_cap; i < new_cap; ++i) {
+    globals[i] = UNIT;
+  }
+  globals_cap = new_cap;
+}
+
+value_t *find_env(env_t env, evar_t *var) {
+  switch (var->scope) {
+  case VAR_LOCAL:
+    return &env->values[var->slot];
+  case VAR_CAPTURED:
+    return &env->closure->captures[var->slot];
+  case VAR_GLOBAL:
+    return &globals[var->slot];
+  case VAR_UNBOUND:
     return NULL;
-  } else {
-    return &env->value;
   }
+  return NULL;
 }
 
-env_t push_env(env_t env, str_t name, value_t value) {
-  env_t newenv = gcalloc(sizeof(*env));
-  newenv->name = name;
-  newenv->value = value;
-  newenv->next = env;
+env_t push_env(vfun_t *closure, usize size) {
+  env_t newenv = gcalloc(sizeof(struct env) + size * sizeof(value_t));
+  newenv->closure = closure;
   return newenv;
 }
 
+// Frames of function calls never outlive the evaluation of their body:
+// closures copy the values they capture, and frames are never linked to each
+// other. They are allocated in a stack region, which is released when the
+// evaluation that pushed them returns. The region is allocated by the
+// collector, so that the values of the frames are scanned.
+#define FRAME_STACK_SIZE (1ul << 16)
+
+// frame stack, in words
+static value_t *frame_stack = NULL;
+static usize frame_top = 0;
+// the frame stack belongs to a single thread: when evaluating on several
+// threads, frames are all allocated on the heap and frame_top stays at 0. The
+// threads then share the nodes, which are no longer quickened, and the flat
+// strings, whose data str_eq no longer rewrites.
+static bool heap_frames = false;
+
+void use_heap_frames() { heap_frames = true; }
+
+#define FRAME_WORDS(__size) (sizeof(struct env) / sizeof(value_t) + (__size))
+
+static bool in_frame_stack(env_t frame) {
+  return (value_t *)frame >= frame_stack &&
+         (value_t *)frame < frame_stack + FRAME_STACK_SIZE;
+}
+
+// allocate the frame of a call, falling back to the heap when the region is
+// full
+static env_t push_frame(vfun_t *closure, usize size) {
+  if (heap_frames) {
+    return push_env(closure, size);
+  }
+  if (frame_stack == NULL) {
+    frame_stack = gcalloc(FRAME_STACK_SIZE * sizeof(value_t));
+  }
+  if (frame_top + FRAME_WORDS(size) > FRAME_STACK_SIZE) {
+    return push_env(closure, size);
+  }
+  env_t frame = (env_t)&frame_stack[frame_top];
+  frame_top += FRAME_WORDS(size);
+  frame->closure = closure;
+  memset(frame->values, 0, size * sizeof(value_t));
+  return frame;
+}
+
+// release the frames pushed since base. frame_top is only written when it
+// changes: with heap frames it stays at 0, and threads don't share writes.
+static inline void pop_frames(usize base) {
+  if (frame_top != base) {
+    frame_top = base;
+  }
+}
+
+// a frame pushed for a tail call replaces the frames of the current evaluation,
+// which start at base: move it down over them
+static env_t settle_frame(env_t frame, usize base) {
+  if (!in_frame_stack(frame)) {
+    return frame;
+  }
+  usize words = FRAME_WORDS(frame->closure->code->frame_size);
+  value_t *dest = &frame_stack[base];
+  if ((value_t *)frame != dest) {
+    memmove(dest, frame, words * sizeof(value_t));
+  }
+  frame_top = base + words;
+  return (env_t)dest;
+}
+
+bool is_local_closure(expr_t *e) {
+  switch (e->kind) {
+  case E_FUN:
+    return true;
+  case E_LET:
+  case E_LETREC:
+    return is_local_closure(e->let.body);
+  case E_IFTHEN:
+    return is_local_closure(e->ifthen.then_body) &&
+           is_local_closure(e->ifthen.else_body);
+  default:
+    return false;
+  }
+}
+
+void tie_knot(value_t fun, usize slot) {
+  if (!is_fun(fun)) {
+    return;
+  }
+  efun_t *code = as_fun(fun)->code;
+  for (usize i = 0; i < code->ncaptures; ++i) {
+    evar_t *var = &code->captures[i];
+    if (var->scope == VAR_LOCAL && var->slot == slot) {
+      as_fun(fun)->captures[i] = fun;
+    }
+  }
+}
+
+vfun_t *make_closure(efun_t *code) {
+  vfun_t *fun = gcalloc(sizeof(vfun_t) + code->ncaptures * sizeof(value_t));
+  fun->code = code;
+  fun->memo = NULL;
+  atomic_init(&fun->calls, 0);
+  return fun;
+}
+
+value_t make_pap(vfun_t *fun, value_t *args, usize nargs) {
+  vpap_t *pap = gcalloc(sizeof(vpap_t) + nargs * sizeof(value_t));
+  pap->fun = fun;
+  pap->nargs = nargs;
+  memcpy(pap->args, args, nargs * sizeof(value_t));
+  return value_pap(pap);
+}
+
+bool is_function(value_t val) { return is_fun(val) || is_pap(val); }
+
+valuekind_t value_kind(value_t val) {
+  if (is_num(val)) {
+    return V_NUM;
+  } else if (is_small_int(val)) {
+    return V_INT;
+  } else if (is_unit(val)) {
+    return V_UNIT;
+  }
+  switch (val.bits & TAG_MASK) {
+  case TAG_FUN:
+    return V_FUN;
+  case TAG_PAP:
+    return V_PAP;
+  case TAG_STR:
+    return V_STR;
+  case TAG_BOOL:
+    return V_BOOL;
+  case TAG_INT:
+    return V_INT;
+  default:
+    return V_ERROR;
+  }
+}
+
+value_t make_int(i64 integer) {
+  i64 *box = gcalloc_atomic(sizeof(i64));
+  *box = integer;
+  return value_ptr(box, TAG_INT);
+}
+
+value_t make_str(str_t str) {
+  vstr_t *box = gcalloc(sizeof(vstr_t));
+  box->str = str;
+  atomic_init(&box->hash, 0);
+  return value_ptr(box, TAG_STR);
+}
+
+// strings up to this length are copied when concatenated, instead of being
+// shared by a rope
+#define ROPE_LEAF 64
+// deeper ropes are rebuilt as balanced trees of their flat strings, which also
+// bounds the stacks used to walk them
+#define ROPE_MAX_DEPTH 256
+// maximum length of the flat strings made from runs of short ones when a rope
+// is rebuilt
+#define ROPE_CHUNK 4096
+
+static bool is_rope(value_t str) {
+  str_t *s = as_ptr(str);
+  return s->data == NULL && s->len > 0;
+}
+
+static usize rope_depth(value_t str) {
+  return is_rope(str) ? ((vrope_t *)as_ptr(str))->depth : 0;
+}
+
+static value_t make_rope(value_t left, value_t right) {
+  vrope_t *rope = gcalloc(sizeof(vrope_t));
+  rope->str = (str_t){.len = str_len(left) + str_len(right), .data = NULL};
+  atomic_init(&rope->hash, 0);
+  atomic_init(&rope->flat, NULL);
+  atomic_init(&rope->left, left);
+  atomic_init(&rope->right, right);
+  usize depth = rope_depth(left);
+  if (rope_depth(right) > depth) {
+    depth = rope_depth(right);
+  }
+  rope->depth = depth + 1;
+  return value_ptr(rope, TAG_STR);
+}
+
+static value_t concat_flat(str_t l, str_t r) {
+  bytes_t bytes = bytes_new();
+  bytes_reserve(&bytes, l.len + r.len);
+  memcpy(&bytes.data[0], l.data, l.len);
+  memcpy(&bytes.data[l.len], r.data, r.len);
+  return make_str(str_make(bytes.data, l.len + r.len));
+}
+
+static value_t rope_build(value_t *leaves, usize n) {
+  if (n == 1) {
+    return leaves[0];
+  }
+  return make_rope(rope_build(leaves, n / 2),
+                   rope_build(leaves + n / 2, n - n / 2));
+}
+
+typedef struct leaves {
+  value_t *data;
+  usize len;
+  usize cap;
+} leaves_t;
+
+static void leaves_push(leaves_t *leaves, value_t leaf) {
+  if (leaves->len == leaves->cap) {
+    leaves->cap = (leaves->cap == 0) ? 64 : (leaves->cap * 2);
+    leaves->data = gcrealloc(leaves->data, leaves->cap * sizeof(value_t));
+  }
+  leaves->data[leaves->len++] = leaf;
+}
+
+// Ropes are shared between threads, and flattened under a lock. The contents
+// are stored before the halves are dropped, so a thread that reads a dropped
+// half sees the contents.
+static once_flag PRIVATE_ROPE_INIT = ONCE_FLAG_INIT;
+static mtx_t PRIVATE_ROPE_LOCK;
+
+static void init_rope_lock() { mtx_init(&PRIVATE_ROPE_LOCK, mtx_plain); }
+
+// read the halves of a rope, unless it was flattened
+static bool rope_halves(vrope_t *rope, value_t *left, value_t *right) {
+  *left = atomic_load_explicit(&rope->left, memory_order_acquire);
+  *right = atomic_load_explicit(&rope->right, memory_order_acquire);
+  return !is_unit(*left) && !is_unit(*right);
+}
+
+// rebuild a rope as a balanced tree, copying runs of short strings into
+// chunks so that later rebuilds have fewer leaves
+static value_t rope_balance(value_t rope) {
+  leaves_t leaves = {.data = NULL, .len = 0, .cap = 0};
+  bytes_t chunk = bytes_new();
+  value_t stack[ROPE_MAX_DEPTH + 2];
+  usize top = 0;
+  stack[top++] = rope;
+  while (top > 0) {
+    value_t node = stack[--top];
+    value_t left, right;
+    if (is_rope(node) && rope_halves(as_ptr(node), &left, &right)) {
+      stack[top++] = right;
+      stack[top++] = left;
+      continue;
+    }
+    str_t str = as_str(node);
+    if (chunk.len + str.len > ROPE_CHUNK && chunk.len > 0) {
+      leaves_push(&leaves, make_str(str_make(chunk.data, chunk.len)));
+      chunk = bytes_new();
+    }
+    if (str.len >= ROPE_CHUNK / 2) {
+      leaves_push(&leaves, node);
+      continue;
+    }
+    if (chunk.cap == 0) {
+      bytes_reserve(&chunk, ROPE_CHUNK);
+    }
+    memcpy(&chunk.data[chunk.len], str.data, str.len);
+    chunk.len += str.len;
+  }
+  if (chunk.len > 0) {
+    leaves_push(&leaves, make_str(str_make(chunk.data, chunk.len)));
+  }
+  return rope_build(leaves.data, leaves.len);
+}
+
+// Concatenating strings only copies short ones. Appending a short string to a
+// rope that ends with a short string copies them into a new last leaf, so that
+// building a string piecewise makes leaves of a useful size.
+static value_t concat_str(value_t lhs, value_t rhs) {
+  usize llen = str_len(lhs);
+  usize rlen = str_len(rhs);
+  if (llen == 0) {
+    return rhs;
+  } else if (rlen == 0) {
+    return lhs;
+  } else if (llen + rlen <= ROPE_LEAF) {
+    return concat_flat(as_str(lhs), as_str(rhs));
+  }
+  value_t left, right;
+  if (is_rope(lhs) && rlen < ROPE_LEAF &&
+      rope_halves(as_ptr(lhs), &left, &right) &&
+      str_len(right) + rlen <= ROPE_LEAF) {
+    return make_rope(left, concat_flat(as_str(right), as_str(rhs)));
+  }
+  if (is_rope(rhs) && llen < ROPE_LEAF &&
+      rope_halves(as_ptr(rhs), &left, &right) &&
+      llen + str_len(left) <= ROPE_LEAF) {
+    return make_rope(concat_flat(as_str(lhs), as_str(left)), right);
+  }
+  value_t rope = make_rope(lhs, rhs);
+  if (rope_depth(rope) > ROPE_MAX_DEPTH) {
+    return rope_balance(rope);
+  }
+  return rope;
+}
+
+str_t rope_flatten(vrope_t *rope) {
+  u8 *flat = atomic_load_explicit(&rope->flat, memory_order_acquire);
+  if (flat != NULL) {
+    return (str_t){.len = rope->str.len, .data = flat};
+  }
+  call_once(&PRIVATE_ROPE_INIT, init_rope_lock);
+  mtx_lock(&PRIVATE_ROPE_LOCK);
+  flat = atomic_load_explicit(&rope->flat, memory_order_relaxed);
+  if (flat != NULL) {
+    mtx_unlock(&PRIVATE_ROPE_LOCK);
+    return (str_t){.len = rope->str.len, .data = flat};
+  }
+  // copy the flat strings from the last one, so that the halves of a rope are
+  // pushed in order
+  u8 *data = gcalloc_atomic(rope->str.len);
+  usize end = rope->str.len;
+  value_t stack[ROPE_MAX_DEPTH + 2];
+  usize top = 0;
+  stack[top++] = atomic_load_explicit(&rope->left, memory_order_relaxed);
+  stack[top++] = atomic_load_explicit(&rope->right, memory_order_relaxed);
+  while (top > 0) {
+    value_t node = stack[--top];
+    value_t left, right;
+    if (is_rope(node) && rope_halves(as_ptr(node), &left, &right)) {
+      stack[top++] = left;
+      stack[top++] = right;
+      continue;
+    }
+    str_t str = as_str(node);
+    end -= str.len;
+    memcpy(&data[end], str.data, str.len);
+  }
+  atomic_store_explicit(&rope->flat, data, memory_order_release);
+  atomic_store_explicit(&rope->left, UNIT, memory_order_release);
+  atomic_store_explicit(&rope->right, UNIT, memory_order_release);
+  mtx_unlock(&PRIVATE_ROPE_LOCK);
+  return (str_t){.len = rope->str.len, .data = data};
+}
+
+value_t make_error(str_t msg) {
+  str_t *box = gcalloc(sizeof(str_t));
+  *box = msg;
+  return value_ptr(box, TAG_ERROR);
+}
+
+value_t value_neg(value_t rhs) {
+  if (is_num(rhs)) {
+    return value_num(-as_num(rhs));
+  } else if (is_int(rhs)) {
+    return int_sub(0, as_int(rhs));
+  } else if (is_bool(rhs)) {
+    return rhs;
+  } else {
+    return ERROR("negation operand is not a number");
+  }
+}
+
+value_t value_add(value_t lhs, value_t rhs) {
+  if (is_int(lhs) && is_int(rhs)) {
+    return int_add(as_int(lhs), as_int(rhs));
+  } else if (is_number(lhs) && is_number(rhs)) {
+    return value_num(as_float(lhs) + as_float(rhs));
+  }
+  if (value_kind(lhs) != value_kind(rhs)) {
+    return ERROR("incompatible types in addition");
+  }
+  switch (value_kind(lhs)) {
+  case V_NUM:
+    return value_num(as_num(lhs) + as_num(rhs));
+  case V_BOOL:
+    return value_bool(as_bool(lhs) ^ as_bool(rhs));
+  case V_STR:
+    return concat_str(lhs, rhs);
+  default:
+    return ERROR("cannot add this type");
+  }
+}
+
+value_t value_sub(value_t lhs, value_t rhs) {
+  if (is_int(lhs) && is_int(rhs)) {
+    return int_sub(as_int(lhs), as_int(rhs));
+  } else if (is_number(lhs) && is_number(rhs)) {
+    return value_num(as_float(lhs) - as_float(rhs));
+  }
+  if (value_kind(lhs) != value_kind(rhs)) {
+    return ERROR("incompatible types in substraction");
+  }
+  switch (value_kind(lhs)) {
+  case V_NUM:
+    return value_num(as_num(lhs) - as_num(rhs));
+  case V_BOOL:
+    return value_bool(as_bool(lhs) ^ as_bool(rhs));
+  default:
+    return ERROR("cannot substract this type");
+  }
+}
+
+value_t value_mul(value_t lhs, value_t rhs) {
+  if (is_int(lhs) && is_int(rhs)) {
+    return int_mul(as_int(lhs), as_int(rhs));
+  } else if (is_number(lhs) && is_number(rhs)) {
+    return value_num(as_float(lhs) * as_float(rhs));
+  }
+  if (value_kind(lhs) != value_kind(rhs)) {
+    return ERROR("incompatible types in multiplication");
+  }
+  switch (value_kind(lhs)) {
+  case V_NUM:
+    return value_num(as_num(lhs) * as_num(rhs));
+  case V_BOOL:
+    return value_bool(as_bool(lhs) & as_bool(rhs));
+  default:
+    return ERROR("cannot substract this type");
+  }
+}
+
+value_t value_div(value_t lhs, value_t rhs) {
+  if (is_int(lhs) && is_int(rhs)) {
+    // the quotient of integers is an integer only when it is exact
+    i64 l = as_int(lhs);
+    i64 r = as_int(rhs);
+    if (r != 0 && !(l == INT64_MIN && r == -1) && l % r == 0) {
+      return value_int(l / r);
+    }
+  }
+  if (is_number(lhs) && is_number(rhs)) {
+    return value_num(as_float(lhs) / as_float(rhs));
+  }
+  if (value_kind(lhs) != value_kind(rhs)) {
+    return ERROR("incompatible types in division");
+  }
+  switch (value_kind(lhs)) {
+  case V_NUM:
+    return value_num(as_num(lhs) / as_num(rhs));
+  default:
+    return ERROR("cannot divide this type");
+  }
+}
+
+u64 str_value_hash(value_t val) {
+  vstr_t *str = as_ptr(val);
+  // threads computing the hash at the same time store the same value
+  u64 hash = atomic_load_explicit(&str->hash, memory_order_relaxed);
+  if (hash == 0) {
+    hash = str_hash(as_str(val));
+    atomic_store_explicit(&str->hash, hash, memory_order_relaxed);
+  }
+  return hash;
+}
+
+// contents of a string, or NULL for a rope that was not flattened yet
+static u8 *str_contents(value_t val) {
+  if (is_rope(val)) {
+    vrope_t *rope = as_ptr(val);
+    return atomic_load_explicit(&rope->flat, memory_order_acquire);
+  }
+  return ((str_t *)as_ptr(val))->data;
+}
+
+bool str_eq(value_t lhs, value_t rhs) {
+  vstr_t *l = as_ptr(lhs);
+  vstr_t *r = as_ptr(rhs);
+  // ropes of different lengths are not flattened
+  if (l == r || l->str.len != r->str.len || l->str.len == 0) {
+    return l->str.len == r->str.len;
+  }
+  // literals are interned, and equal strings end up sharing their contents
+  u8 *data = str_contents(lhs);
+  if (data != NULL && data == str_contents(rhs)) {
+    return true;
+  }
+  if (str_value_hash(lhs) != str_value_hash(rhs) ||
+      !str_comp(as_str(lhs), as_str(rhs))) {
+    return false;
+  }
+  // share the contents, so that comparing them again is a pointer check. The
+  // data of flat strings is only rewritten while a single thread reads it.
+  data = as_str(lhs).data;
+  if (is_rope(rhs)) {
+    vrope_t *rope = as_ptr(rhs);
+    atomic_store_explicit(&rope->flat, data, memory_order_release);
+  } else if (!heap_frames) {
+    r->str.data = data;
+  }
+  return true;
+}
+
+value_t value_eq(value_t lhs, value_t rhs) {
+  if (is_int(lhs) && is_int(rhs)) {
+    return value_bool(as_int(lhs) == as_int(rhs));
+  } else if (is_number(lhs) && is_number(rhs)) {
+    return value_bool(as_float(lhs) == as_float(rhs));
+  }
+  if (value_kind(lhs) != value_kind(rhs)) {
+    return ERROR("incompatible types in equality");
+  }
+  switch (value_kind(lhs)) {
+  case V_NUM:
+    return value_bool(as_num(lhs) == as_num(rhs));
+  case V_BOOL:
+    return value_bool(as_bool(lhs) == as_bool(rhs));
+  case V_STR:
+    return value_bool(str_eq(lhs, rhs));
+  case V_UNIT:
+    return value_bool(true);
+  default:
+    return ERROR("cannot compare this type");
+  }
+}
+
+static value_t eval_frames(env_t env, expr_t *expr, usize base, bool call);
+
+// evaluate the body of a closure in the frame of a call, with its native code
+// if it has some
+static value_t eval_call(env_t frame) {
+  usize base = frame_top;
+  value_t result = eval_frames(frame, frame->closure->code->body, base, true);
+  pop_frames(base);
+  return result;
+}
+
+// call a memoized closure whose arguments are in the frame, through its cache.
+// Return false without evaluating anything if the arguments can't be cached.
+static bool call_memo(vfun_t *fun, env_t frame, value_t *result) {
+  memo_key_t key;
+  if (!memo_key(frame->values, fun->code->arity, &key)) {
+    return false;
+  }
+  memo_t memo = memo_of(fun);
+  if (memo_get(memo, key, result)) {
+    return true;
+  }
+  *result = eval_call(frame);
+  if (!is_error(*result)) {
+    memo_insert(memo, key, *result);
+  }
+  return true;
+}
+
+// Set up the call of a function value. Partial applications are unpacked, and
+// the calls needed by an over-application are evaluated, until only a single
+// saturated call remains: its frame and body are then returned through env
+// and expr, so it can be evaluated in tail position. If the call results
+// directly in a value (a partial application or an error), it is returned
+// through result instead, and the function returns false.
+static bool prepare_call(value_t callee, value_t *args, usize nargs,
+                         env_t *env, expr_t **expr, value_t *result) {
+  loop {
+    if (is_pap(callee)) {
+      vpap_t *pap = as_pap(callee);
+      value_t *all = gcalloc((pap->nargs + nargs) * sizeof(value_t));
+      memcpy(all, pap->args, pap->nargs * sizeof(value_t));
+      memcpy(all + pap->nargs, args, nargs * sizeof(value_t));
+      callee = value_fun(pap->fun);
+      args = all;
+      nargs += pap->nargs;
+    }
+    if (!is_fun(callee)) {
+      *result = ERROR("trying to call non function");
+      return false;
+    }
+    efun_t *code = as_fun(callee)->code;
+    if (nargs < code->arity) {
+      *result = make_pap(as_fun(callee), args, nargs);
+      return false;
+    }
+    env_t frame = push_frame(as_fun(callee), code->frame_size);
+    memcpy(frame->values, args, code->arity * sizeof(value_t));
+    value_t value;
+    bool done = code->memo && call_memo(as_fun(callee), frame, &value);
+    if (nargs == code->arity) {
+      if (done) {
+        *result = value;
+        return false;
+      }
+      *env = frame;
+      *expr = code->body;
+      return true;
+    }
+    callee = done ? value : eval_call(frame);
+    if (is_error(callee)) {
+      *result = callee;
+      return false;
+    }
+    args += code->arity;
+    nargs -= code->arity;
+  }
+}
+
+// evaluate the arguments of a call node, and set up the call like prepare_call
+static bool prepare_call_node(value_t callee, env_t *env, expr_t **expr,
+                              value_t *result) {
+  ecall_t *call = &(*expr)->call;
+  value_t *args = gcalloc(call->nargs * sizeof(value_t));
+  for (usize i = 0; i < call->nargs; ++i) {
+    args[i] = eval_expr(*env, &call->args[i]);
+    if (is_error(args[i])) {
+      *result = args[i];
+      return false;
+    }
+  }
+  return prepare_call(callee, args, call->nargs, env, expr, result);
+}
+
+value_t apply(value_t callee, value_t *args, usize nargs) {
+  usize base = frame_top;
+  env_t env;
+  expr_t *expr;
+  value_t result;
+  if (prepare_call(callee, args, nargs, &env, &expr, &result)) {
+    result = eval_call(env);
+  }
+  pop_frames(base);
+  return result;
+}
+
 value_t eval_expr(env_t env, expr_t *expr) {
+  usize base = frame_top;
+  value_t result = eval_frames(env, expr, base, false);
+  pop_frames(base);
+  return result;
+}
+
+// Evaluate an expression, with the frames pushed by its tail calls starting at
+// base in the frame stack. If call is set, the expression is the body of the
+// closure of the frame, which may run as native code.
+static value_t eval_frames(env_t env, expr_t *expr, usize base, bool call) {
+  if (!call) {
+    goto __start;
+  }
+__call:
+  // env is the frame of a call, and expr the body of its function
+  if (jit_hot(env->closure)) {
+    struct native *native =
+        atomic_load_explicit(&env->closure->code->native, memory_order_acquire);
+    value_t result = native->run(env);
+    if (!is_tail_call(result)) {
+      return result;
+    }
+    tail_call_t tail = *native_tail_call();
+    if (!prepare_call(tail.callee, tail.args, tail.nargs, &env, &expr,
+                      &result)) {
+      return result;
+    }
+    env = settle_frame(env, base);
+    goto __call;
+  }
 __start:
   switch (expr->kind) {
   case E_NUM:
-    return (value_t){.kind = V_NUM, .num = expr->num};
+    return value_num(expr->num);
+  case E_INT:
+    return value_int(expr->integer);
   case E_STR:
-    return (value_t){.kind = V_STR, .str = expr->str};
+    return value_str(&expr->str);
   case E_BOOL:
-    return (value_t){.kind = V_BOOL, .boolean = expr->boolean};
+    return value_bool(expr->boolean);
   case E_UNIT:
-    return (value_t){.kind = V_UNIT};
+    return UNIT;
   case E_VAR: {
-    value_t *val = find_env(env, expr->var.name);
+    value_t *val = find_env(env, &expr->var);
     if (val == NULL) {
       return ERROR("unknown binding");
     } else {
@@ -55,44 +744,90 @@ __start:
   }
   case E_CALL: {
     EVAL(callee, env, expr->call.callee);
-    EVAL(param, env, expr->call.param);
-    if (callee.kind != V_FUN) {
-      return ERROR("trying to call non function");
-    } else {
-      env = push_env(callee.fun->env, callee.fun->param, param);
-      expr = callee.fun->expr;
-      goto __start;
+    usize nargs = expr->call.nargs;
+    if (is_fun(callee) && as_fun(callee)->code->arity == nargs) {
+      // saturated call: evaluate the arguments directly into the new frame
+      efun_t *code = as_fun(callee)->code;
+      if (!heap_frames && !code->memo && expr->call.deopts < QUICKEN_LIMIT) {
+        expr->call.cache = code;
+        expr->kind = E_CALL_FUN;
+      }
+      env_t frame = push_frame(as_fun(callee), code->frame_size);
+      for (usize i = 0; i < nargs; ++i) {
+        EVAL(arg, env, &expr->call.args[i]);
+        frame->values[i] = arg;
+      }
+      value_t result;
+      if (code->memo && call_memo(as_fun(callee), frame, &result)) {
+        return result;
+      }
+      env = settle_frame(frame, base);
+      expr = code->body;
+      goto __call;
+    }
+    value_t result;
+    if (prepare_call_node(callee, &env, &expr, &result)) {
+      env = settle_frame(env, base);
+      goto __call;
+    }
+    return result;
+  }
+  case E_CALL_FUN: {
+    // monomorphic call site: saturated call of closures of the same function,
+    // which is not memoized, so the arguments go straight into its frame
+    EVAL(callee, env, expr->call.callee);
+    efun_t *code = expr->call.cache;
+    if (!is_fun(callee) || as_fun(callee)->code != code) {
+      DEOPTIMIZE(expr->call, E_CALL);
+      value_t result;
+      if (prepare_call_node(callee, &env, &expr, &result)) {
+        env = settle_frame(env, base);
+        goto __call;
+      }
+      return result;
     }
+    env_t frame = push_frame(as_fun(callee), code->frame_size);
+    for (usize i = 0; i < expr->call.nargs; ++i) {
+      EVAL(arg, env, &expr->call.args[i]);
+      frame->values[i] = arg;
+    }
+    env = settle_frame(frame, base);
+    expr = code->body;
+    goto __call;
   }
   case E_LET: {
     EVAL(value, env, expr->let.expr);
-    env = push_env(env, expr->let.name, value);
+    env->values[expr->let.slot] = value;
     expr = expr->let.body;
     goto __start;
   }
   case E_LETREC: {
     EVAL(fun, env, expr->let.expr);
-    if (fun.kind != V_FUN) {
+    if (!is_function(fun)) {
       return ERROR("let rec binding can only be used with a function");
     } else {
-      fun.fun->env = push_env(fun.fun->env, expr->let.name, fun);
-      env = push_env(env, expr->let.name, fun);
+      env->values[expr->let.slot] = fun;
+      if (is_local_closure(expr->let.expr)) {
+        tie_knot(fun, expr->let.slot);
+      }
       expr = expr->let.body;
       goto __start;
     }
   }
   case E_FUN: {
-    vfun_t *fun = gcalloc(sizeof(vfun_t));
-    fun->env = env;
-    fun->param = expr->fun.param;
-    fun->expr = expr->fun.body;
-    return (value_t){.kind = V_FUN, .fun = fun};
+    efun_t *code = &expr->fun;
+    vfun_t *fun = make_closure(code);
+    for (usize i = 0; i < code->ncaptures; ++i) {
+      value_t *val = find_env(env, &code->captures[i]);
+      fun->captures[i] = *val;
+    }
+    return value_fun(fun);
   }
   case E_IFTHEN: {
     EVAL(cond, env, expr->ifthen.cond);
-    if (cond.kind != V_BOOL) {
+    if (!is_bool(cond)) {
       return ERROR("condition is not a boolean");
-    } else if (cond.boolean) {
+    } else if (as_bool(cond)) {
       expr = expr->ifthen.then_body;
     } else {
       expr = expr->ifthen.else_body;
@@ -101,99 +836,135 @@ __start:
   }
   case E_NEG: {
     EVAL(rhs, env, expr->unop.rhs);
-    if (rhs.kind == V_NUM) {
-      return (value_t){.kind = V_NUM, .num = -rhs.num};
-    } else if (rhs.kind == V_BOOL) {
-      return rhs;
-    } else {
-      return ERROR("negation operand is not a number");
-    }
+    return value_neg(rhs);
   }
   case E_ADD: {
     EVAL(lhs, env, expr->binop.lhs);
     EVAL(rhs, env, expr->binop.rhs);
-    if (lhs.kind != rhs.kind) {
-      return ERROR("incompatible types in addition");
+    if (is_small_int(lhs) && is_small_int(rhs)) {
+      QUICKEN(expr->binop, E_ADD_INT);
+    } else if (is_num(lhs) && is_num(rhs)) {
+      QUICKEN(expr->binop, E_ADD_NUM);
     }
-    switch (lhs.kind) {
-    case V_NUM:
-      return (value_t){.kind = V_NUM, .num = lhs.num + rhs.num};
-    case V_BOOL:
-      return (value_t){.kind = V_BOOL, .boolean = lhs.boolean ^ rhs.boolean};
-    case V_STR: {
-      bytes_t bytes = bytes_new();
-      bytes_reserve(&bytes, lhs.str.len + rhs.str.len);
-      memcpy(&bytes.data[0], lhs.str.data, lhs.str.len);
-      memcpy(&bytes.data[lhs.str.len], rhs.str.data, rhs.str.len);
-
-      str_t res = str_make(bytes.data, lhs.str.len + rhs.str.len);
-      return (value_t){.kind = V_STR, .str = res};
+    return value_add(lhs, rhs);
+  }
+  case E_ADD_NUM: {
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    if (is_num(lhs) && is_num(rhs)) {
+      return value_num(as_num(lhs) + as_num(rhs));
     }
-    default:
-      return ERROR("cannot add this type");
+    DEOPTIMIZE(expr->binop, E_ADD);
+    return value_add(lhs, rhs);
+  }
+  case E_ADD_INT: {
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    if (is_small_int(lhs) && is_small_int(rhs)) {
+      return value_int(as_small_int(lhs) + as_small_int(rhs));
     }
+    DEOPTIMIZE(expr->binop, E_ADD);
+    return value_add(lhs, rhs);
   }
   case E_SUB: {
     EVAL(lhs, env, expr->binop.lhs);
     EVAL(rhs, env, expr->binop.rhs);
-    if (lhs.kind != rhs.kind) {
-      return ERROR("incompatible types in substraction");
+    if (is_small_int(lhs) && is_small_int(rhs)) {
+      QUICKEN(expr->binop, E_SUB_INT);
+    } else if (is_num(lhs) && is_num(rhs)) {
+      QUICKEN(expr->binop, E_SUB_NUM);
     }
-    switch (lhs.kind) {
-    case V_NUM:
-      return (value_t){.kind = V_NUM, .num = lhs.num - rhs.num};
-    case V_BOOL:
-      return (value_t){.kind = V_BOOL, .boolean = lhs.boolean ^ rhs.boolean};
-    default:
-      return ERROR("cannot substract this type");
+    return value_sub(lhs, rhs);
+  }
+  case E_SUB_NUM: {
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    if (is_num(lhs) && is_num(rhs)) {
+      return value_num(as_num(lhs) - as_num(rhs));
     }
+    DEOPTIMIZE(expr->binop, E_SUB);
+    return value_sub(lhs, rhs);
+  }
+  case E_SUB_INT: {
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    if (is_small_int(lhs) && is_small_int(rhs)) {
+      return value_int(as_small_int(lhs) - as_small_int(rhs));
+    }
+    DEOPTIMIZE(expr->binop, E_SUB);
+    return value_sub(lhs, rhs);
   }
   case E_MUL: {
     EVAL(lhs, env, expr->binop.lhs);
     EVAL(rhs, env, expr->binop.rhs);
-    if (lhs.kind != rhs.kind) {
-      return ERROR("incompatible types in multiplication");
+    if (is_small_int(lhs) && is_small_int(rhs)) {
+      QUICKEN(expr->binop, E_MUL_INT);
+    } else if (is_num(lhs) && is_num(rhs)) {
+      QUICKEN(expr->binop, E_MUL_NUM);
     }
-    switch (lhs.kind) {
-    case V_NUM:
-      return (value_t){.kind = V_NUM, .num = lhs.num * rhs.num};
-    case V_BOOL:
-      return (value_t){.kind = V_BOOL, .boolean = lhs.boolean & rhs.boolean};
-    default:
-      return ERROR("cannot substract this type");
+    return value_mul(lhs, rhs);
+  }
+  case E_MUL_NUM: {
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    if (is_num(lhs) && is_num(rhs)) {
+      return value_num(as_num(lhs) * as_num(rhs));
     }
+    DEOPTIMIZE(expr->binop, E_MUL);
+    return value_mul(lhs, rhs);
+  }
+  case E_MUL_INT: {
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    if (is_small_int(lhs) && is_small_int(rhs)) {
+      return int_mul(as_small_int(lhs), as_small_int(rhs));
+    }
+    DEOPTIMIZE(expr->binop, E_MUL);
+    return value_mul(lhs, rhs);
   }
   case E_DIV: {
     EVAL(lhs, env, expr->binop.lhs);
     EVAL(rhs, env, expr->binop.rhs);
-    if (lhs.kind != rhs.kind) {
-      return ERROR("incompatible types in division");
+    return value_div(lhs, rhs);
+  }
+  case E_EQ: {
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    if (is_small_int(lhs) && is_small_int(rhs)) {
+      QUICKEN(expr->binop, E_EQ_INT);
+    } else if (is_num(lhs) && is_num(rhs)) {
+      QUICKEN(expr->binop, E_EQ_NUM);
     }
-    switch (lhs.kind) {
-    case V_NUM:
-      return (value_t){.kind = V_NUM, .num = lhs.num / rhs.num};
-    default:
-      return ERROR("cannot divide this type");
+    return value_eq(lhs, rhs);
+  }
+  case E_EQ_NUM: {
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    if (is_num(lhs) && is_num(rhs)) {
+      return value_bool(as_num(lhs) == as_num(rhs));
     }
+    DEOPTIMIZE(expr->binop, E_EQ);
+    return value_eq(lhs, rhs);
   }
-  case E_EQ: {
+  case E_EQ_INT: {
     EVAL(lhs, env, expr->binop.lhs);
     EVAL(rhs, env, expr->binop.rhs);
-    if (lhs.kind != rhs.kind) {
-      return ERROR("incompatible types in equality");
-    }
-    switch (lhs.kind) {
-    case V_NUM:
-      return (value_t){.kind = V_BOOL, .boolean = lhs.num == rhs.num};
-    case V_BOOL:
-      return (value_t){.kind = V_BOOL, .boolean = lhs.boolean == rhs.boolean};
-    case V_STR:
-      return (value_t){.kind = V_BOOL, .boolean = str_comp(lhs.str, rhs.str)};
-    case V_UNIT:
-      return (value_t){.kind = V_BOOL, .boolean = true};
-    default:
-      return ERROR("cannot compare this type");
+    if (is_small_int(lhs) && is_small_int(rhs)) {
+      return value_bool(lhs.bits == rhs.bits);
     }
+    DEOPTIMIZE(expr->binop, E_EQ);
+    return value_eq(lhs, rhs);
+  }
+  case E_ADD_STR: {
+    // operands proven to be strings by the type checker: no guard
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    return concat_str(lhs, rhs);
+  }
+  case E_EQ_STR: {
+    EVAL(lhs, env, expr->binop.lhs);
+    EVAL(rhs, env, expr->binop.rhs);
+    return value_bool(str_eq(lhs, rhs));
   }
   case E_ERROR:
   case E_NOMATCH:
@@ -202,43 +973,53 @@ __start:
   return ERROR("unreachable");
 }
 
-env_t walk_file(env_t env, toplevel_t *tl) {
+value_t eval_toplevel(toplevel_t *tl) {
   switch (tl->kind) {
-  case TL_EXPR: {
-    value_t val = eval_expr(env, &tl->expr);
-    if (val.kind != V_UNIT) {
-      fprint_value(stdout, &val);
-      println("");
-    }
-    return env;
-  }
-  case TL_LET: {
-    value_t binding = eval_expr(env, &tl->let.expr);
-    return push_env(env, tl->let.name, binding);
+  case TL_EXPR:
+    return eval_expr(push_env(NULL, tl->frame_size), &tl->expr);
+  case TL_LET:
+  case TL_LETREC:
+    // a recursive binding refers to itself through its global slot, which is
+    // filled in before any call can read it
+    globals[tl->let.global] =
+        eval_expr(push_env(NULL, tl->frame_size), &tl->let.expr);
+    return UNIT;
+  case TL_ERROR:
+    break;
   }
-  case TL_LETREC: {
-    value_t binding = eval_expr(env, &tl->let.expr);
-    if (binding.kind == V_FUN) {
-      binding.fun->env = push_env(binding.fun->env, tl->let.name, binding);
-    }
-    return push_env(env, tl->let.name, binding);
+  return UNIT;
+}
+
+void walk_file(toplevel_t *tl) {
+  if (tl->kind == TL_LET || tl->kind == TL_LETREC) {
+    globals_reserve(tl->let.global + 1);
   }
-  case TL_ERROR:
-    return env;
+  value_t val = eval_toplevel(tl);
+  print_result(&val);
+}
+
+void print_result(value_t *val) {
+  if (!is_unit(*val)) {
+    fprint_value(stdout, val);
+    println("");
   }
-  return env;
 }
 
 void fprint_value(FILE *f, value_t *val) {
-  switch (val->kind) {
+  switch (value_kind(*val)) {
   case V_NUM:
-    fprintf(f, "%.*g", 16, val->num);
+    fprintf(f, "%.*g", 16, as_num(*val));
     break;
-  case V_STR:
-    fdebug_str(f, val->str.data, val->str.len);
+  case V_INT:
+    fprintf(f, "%" PRId64, as_int(*val));
     break;
+  case V_STR: {
+    str_t str = as_str(*val);
+    fdebug_str(f, str.data, str.len);
+    break;
+  }
   case V_BOOL:
-    if (val->boolean) {
+    if (as_bool(*val)) {
       fprintf(f, "true");
     } else {
       fprintf(f, "false");
@@ -247,10 +1028,13 @@ void fprint_value(FILE *f, value_t *val) {
   case V_UNIT:
     break;
   case V_FUN:
+  case V_PAP:
     fprintf(f, "<function>");
     break;
-  case V_ERROR:
-    fprintf(f, "ERROR: %.*s", (int)(val->error.len), val->error.data);
+  case V_ERROR: {
+    str_t error = as_error(*val);
+    fprintf(f, "ERROR: %.*s", (int)(error.len), error.data);
     break;
   }
+  }
 }
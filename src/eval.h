@@ -2,46 +2,269 @@
 
 #include "ast.h"
 #include "utils.h"
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 typedef struct env *env_t;
 
 typedef enum valuekind {
   V_ERROR = -1,
   V_UNIT,
+  // floating point number
   V_NUM,
+  // 64-bit integer
+  V_INT,
   V_STR,
   V_BOOL,
-  V_FUN
+  V_FUN,
+  V_PAP,
 } valuekind_t;
 
-typedef struct vfun {
-  str_t param;
-  expr_t *expr;
-  env_t env;
-} vfun_t;
+typedef struct vfun vfun_t;
+typedef struct vpap vpap_t;
+typedef struct vstr vstr_t;
+typedef struct vrope vrope_t;
 
+// Values are NaN-boxed into a single 64-bit word. Floats are stored as their
+// bits plus NUM_OFFSET, so their top 15 bits are never all zero (NaNs are
+// canonicalized first). Integers that fit in 48 bits are stored offset in the
+// range between INT_OFFSET and NUM_OFFSET, larger ones are boxed. Every other
+// value has its top 16 bits zero: unit is 0, and the rest are booleans or
+// pointers to heap objects, with their kind in the 3 low bits left free by
+// alignment. Pointers keep their address, so that the GC still sees them.
 typedef struct value {
-  valuekind_t kind;
-  union {
-    str_t error;
-    f64 num;
-    str_t str;
-    bool boolean;
-    vfun_t *fun;
-  };
+  u64 bits;
 } value_t;
 
+#define NUM_OFFSET (1ul << 49)
+#define CANONICAL_NAN 0x7ff8000000000000ul
+#define INT_OFFSET (1ul << 48)
+#define SMALL_INT_MIN (-(1l << 47))
+#define SMALL_INT_MAX ((1l << 47) - 1)
+
+#define TAG_MASK 7ul
+#define TAG_FUN 0ul
+#define TAG_PAP 1ul
+#define TAG_STR 2ul
+#define TAG_ERROR 3ul
+#define TAG_BOOL 4ul
+#define TAG_INT 5ul
+
+#define UNIT ((value_t){.bits = 0})
+
+static inline bool is_num(value_t val) { return val.bits >= NUM_OFFSET; }
+static inline bool is_small_int(value_t val) {
+  return (val.bits >> 48) == 1;
+}
+static inline bool has_tag(value_t val, u64 tag) {
+  return val.bits < INT_OFFSET && (val.bits & TAG_MASK) == tag;
+}
+static inline bool is_int(value_t val) {
+  return is_small_int(val) || has_tag(val, TAG_INT);
+}
+static inline bool is_unit(value_t val) { return val.bits == 0; }
+static inline bool is_bool(value_t val) { return has_tag(val, TAG_BOOL); }
+static inline bool is_error(value_t val) { return has_tag(val, TAG_ERROR); }
+static inline bool is_fun(value_t val) {
+  return val.bits != 0 && has_tag(val, TAG_FUN);
+}
+static inline bool is_pap(value_t val) { return has_tag(val, TAG_PAP); }
+valuekind_t value_kind(value_t val);
+
+static inline value_t value_num(f64 num) {
+  u64 bits = CANONICAL_NAN;
+  if (num == num) {
+    memcpy(&bits, &num, sizeof(f64));
+  }
+  return (value_t){.bits = bits + NUM_OFFSET};
+}
+// allocate a boxed integer, for integers that don't fit in 48 bits
+value_t make_int(i64 integer);
+static inline value_t value_int(i64 integer) {
+  if (integer < SMALL_INT_MIN || integer > SMALL_INT_MAX) {
+    return make_int(integer);
+  }
+  return (value_t){.bits = INT_OFFSET + (u64)(integer - SMALL_INT_MIN)};
+}
+static inline value_t value_bool(bool boolean) {
+  return (value_t){.bits = TAG_BOOL | ((u64)boolean << 3)};
+}
+static inline value_t value_ptr(const void *ptr, u64 tag) {
+  return (value_t){.bits = (u64)(uintptr_t)ptr | tag};
+}
+// a string value referring to a string that outlives it, like a literal. It
+// must be laid out like a vstr_t, with room for its hash.
+static inline value_t value_str(str_t *str) {
+  return value_ptr(str, TAG_STR);
+}
+static inline value_t value_fun(vfun_t *fun) { return value_ptr(fun, TAG_FUN); }
+static inline value_t value_pap(vpap_t *pap) { return value_ptr(pap, TAG_PAP); }
+// allocate a new string value
+value_t make_str(str_t str);
+// allocate a new error value
+value_t make_error(str_t msg);
+
+static inline f64 as_num(value_t val) {
+  u64 bits = val.bits - NUM_OFFSET;
+  f64 num;
+  memcpy(&num, &bits, sizeof(f64));
+  return num;
+}
+static inline i64 as_small_int(value_t val) {
+  return (i64)(val.bits - INT_OFFSET) + SMALL_INT_MIN;
+}
+static inline bool as_bool(value_t val) { return (val.bits >> 3) != 0; }
+static inline void *as_ptr(value_t val) {
+  return (void *)(uintptr_t)(val.bits & ~TAG_MASK);
+}
+static inline i64 as_int(value_t val) {
+  if (is_small_int(val)) {
+    return as_small_int(val);
+  }
+  return *(i64 *)as_ptr(val);
+}
+// integers and floats mix in arithmetic, integers being promoted to floats
+static inline bool is_number(value_t val) { return is_num(val) || is_int(val); }
+static inline f64 as_float(value_t val) {
+  return is_num(val) ? as_num(val) : (f64)as_int(val);
+}
+// concatenate the strings of a rope into a single string, once
+str_t rope_flatten(vrope_t *rope);
+// Strings point to their contents, or are ropes, whose contents are read
+// through rope_flatten. Only ropes have no data with a non-zero length.
+static inline str_t as_str(value_t val) {
+  str_t *str = as_ptr(val);
+  if (str->data == NULL && str->len > 0) {
+    return rope_flatten((vrope_t *)str);
+  }
+  return *str;
+}
+// length of a string value, without flattening it
+static inline usize str_len(value_t val) {
+  return ((str_t *)as_ptr(val))->len;
+}
+// hash of the contents of a string value, computed once
+u64 str_value_hash(value_t val);
+// equality of string values, which mostly avoids comparing their contents
+bool str_eq(value_t lhs, value_t rhs);
+static inline str_t as_error(value_t val) { return *(str_t *)as_ptr(val); }
+static inline vfun_t *as_fun(value_t val) { return as_ptr(val); }
+static inline vpap_t *as_pap(value_t val) { return as_ptr(val); }
+
+// flat closure: the code of the function, and the values of its free variables
+struct vfun {
+  efun_t *code;
+  // cache of results, for memoized functions
+  struct memo *memo;
+  // number of calls, until the code of the function is compiled by the jit.
+  // Threads may share the closure, and count its calls atomically.
+  _Atomic u32 calls;
+  value_t captures[];
+};
+
+// partial application of a closure to fewer arguments than its arity
+struct vpap {
+  vfun_t *fun;
+  usize nargs;
+  value_t args[];
+};
+
+// flat string: its contents, and their hash once it was needed (0 before).
+// Threads may share the string, so the hash is atomic.
+struct vstr {
+  str_t str;
+  _Atomic u64 hash;
+};
+
+// lazy concatenation of two non-empty strings. It starts like a flat string
+// without data: its contents are stored in flat when the rope is first read,
+// and the halves are then dropped (set to unit).
+struct vrope {
+  str_t str;
+  _Atomic u64 hash;
+  _Atomic(u8 *) flat;
+  _Atomic value_t left;
+  _Atomic value_t right;
+  // number of ropes on the longest path down to a flat string
+  usize depth;
+};
+
+// a frame of bindings. Function frames are linked to their closure.
 struct env {
-  str_t name;
-  value_t value;
-  env_t next;
+  vfun_t *closure;
+  value_t values[];
 };
 
-value_t *find_env(env_t env, str_t name);
-env_t push_env(env_t env, str_t name, value_t value);
+// values of the toplevel bindings, indexed by the global slots given by the
+// resolver. Slots that were not evaluated yet hold unit.
+extern value_t *globals;
+// make room for the global slots below len
+void globals_reserve(usize len);
+
+// get the binding at a lexical address computed by the resolver, or NULL if
+// the variable is unbound
+value_t *find_env(env_t env, evar_t *var);
+// allocate a new frame with the given number of slots on the heap
+env_t push_env(vfun_t *closure, usize size);
+// allocate the frames of all calls on the heap, so that several threads can
+// evaluate at once. The frame stack is only used by a single thread.
+void use_heap_frames();
+
+// allocate a closure for the given function, with uninitialized captures
+vfun_t *make_closure(efun_t *code);
+// partially apply a closure to some of its arguments
+value_t make_pap(vfun_t *fun, value_t *args, usize nargs);
+// whether a value can be called
+bool is_function(value_t val);
+// whether the value of an expression is always a closure created in the frame
+// the expression is evaluated in
+bool is_local_closure(expr_t *e);
+// a recursive closure captured its own slot before it was filled: patch the
+// captured copy once the closure exists. This only applies to closures created
+// in the frame of the binding, so `let rec` bindings need to be syntactic
+// functions to refer to themselves.
+void tie_knot(value_t fun, usize slot);
+
+// integer operations, promoted to floats on overflow
+static inline value_t int_add(i64 lhs, i64 rhs) {
+  i64 res;
+  if (__builtin_add_overflow(lhs, rhs, &res)) {
+    return value_num((f64)lhs + (f64)rhs);
+  }
+  return value_int(res);
+}
+static inline value_t int_sub(i64 lhs, i64 rhs) {
+  i64 res;
+  if (__builtin_sub_overflow(lhs, rhs, &res)) {
+    return value_num((f64)lhs - (f64)rhs);
+  }
+  return value_int(res);
+}
+static inline value_t int_mul(i64 lhs, i64 rhs) {
+  i64 res;
+  if (__builtin_mul_overflow(lhs, rhs, &res)) {
+    return value_num((f64)lhs * (f64)rhs);
+  }
+  return value_int(res);
+}
+
+// primitive operations, shared by the evaluation engines
+value_t value_neg(value_t rhs);
+value_t value_add(value_t lhs, value_t rhs);
+value_t value_sub(value_t lhs, value_t rhs);
+value_t value_mul(value_t lhs, value_t rhs);
+value_t value_div(value_t lhs, value_t rhs);
+value_t value_eq(value_t lhs, value_t rhs);
 
 value_t eval_expr(env_t env, expr_t *expr);
-env_t walk_file(env_t env, toplevel_t *tl);
+// call a function value with the tree walker
+value_t apply(value_t callee, value_t *args, usize nargs);
+// evaluate a toplevel, whose global slot must have room, and return the value
+// to print: unit for bindings
+value_t eval_toplevel(toplevel_t *tl);
+void walk_file(toplevel_t *tl);
 
 void fprint_value(FILE *f, value_t *val);
+// print the value of a toplevel expression, if it is not unit
+void print_result(value_t *val);
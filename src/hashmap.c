@@ -33,7 +33,7 @@ static const u64 FNV_BASIS = 0xcbf29ce484222325;
 static const u64 FNV_PRIME = 0x100000001b3;
 
 // fnv hash
-static inline u64 hasher(str_t key) {
+u64 str_hash(str_t key) {
   u64 res = FNV_BASIS;
   for (usize i = 0; i < key.len; ++i) {
     res ^= (u64)(key.data[i]);
@@ -130,8 +130,8 @@ static void hashmap_resize(hashmap_t map) {
   map->buf = new_buf;
 }
 
-static inline keyval_t *hashmap_keyval_get(hashmap_t map, str_t key) {
-  u64 hash = hasher(key);
+static inline keyval_t *hashmap_keyval_get(hashmap_t map, str_t key,
+                                           u64 hash) {
   usize index = hash & map->cap_mask;
   keyval_t *kv = buf_byte_get(map->buf, index * map->entry_size);
 
@@ -162,7 +162,11 @@ hashmap_t hashmap_new(usize elt_size) {
 }
 
 void *hashmap_get(hashmap_t map, str_t key) {
-  keyval_t *kv = hashmap_keyval_get(map, key);
+  return hashmap_get_hashed(map, key, str_hash(key));
+}
+
+void *hashmap_get_hashed(hashmap_t map, str_t key, u64 hash) {
+  keyval_t *kv = hashmap_keyval_get(map, key, hash);
   if (kv == NULL) {
     return NULL;
   } else {
@@ -171,27 +175,35 @@ void *hashmap_get(hashmap_t map, str_t key) {
 }
 
 bool hashmap_contains(hashmap_t map, str_t key) {
-  return hashmap_keyval_get(map, key) != NULL;
+  return hashmap_keyval_get(map, key, str_hash(key)) != NULL;
 }
 
 bool hashmap_insert(hashmap_t map, str_t key, void *value) {
+  return hashmap_insert_hashed(map, key, str_hash(key), value);
+}
+
+bool hashmap_insert_hashed(hashmap_t map, str_t key, u64 hash, void *value) {
   if (4 * map->len >= 3 * (map->cap_mask + 1)) {
     hashmap_resize(map);
   }
 
-  u64 hash = hasher(key);
   usize index = (hash & map->cap_mask);
 
   keyval_t *kv = buf_byte_get(map->buf, index * map->entry_size);
   usize elt_size = map->entry_size - sizeof(keyval_t);
   bool res = keyval_set(kv, hash, key, value, elt_size);
 
-  map->len += 1;
+  if (res) {
+    map->len += 1;
+  }
   return res;
 }
 
 bool hashmap_remove(hashmap_t map, str_t key) {
-  u64 hash = hasher(key);
+  return hashmap_remove_hashed(map, key, str_hash(key));
+}
+
+bool hashmap_remove_hashed(hashmap_t map, str_t key, u64 hash) {
   usize index = (hash & map->cap_mask);
   keyval_t *kv = buf_byte_get(map->buf, index * map->entry_size);
   keyval_t *prev = NULL;
@@ -209,6 +221,7 @@ bool hashmap_remove(hashmap_t map, str_t key) {
       } else {
         prev->next = kv->next;
       }
+      map->len -= 1;
       return true;
     }
     if (kv->next == NULL) {
@@ -226,7 +239,7 @@ bool hashset_contains(hashset_t set, str_t key) {
 }
 
 str_t hashset_get(hashset_t set, str_t key) {
-  keyval_t *kv = hashmap_keyval_get(CAST_SET(set), key);
+  keyval_t *kv = hashmap_keyval_get(CAST_SET(set), key, str_hash(key));
   if (kv == NULL) {
     panic("no such key in hashset");
   } else {
@@ -8,10 +8,15 @@ struct hashmap;
 // polymorphic hashmap keyed by strings
 typedef struct hashmap *hashmap_t;
 
+// hash of a key, as computed by hashmaps. It is never 0.
+u64 str_hash(str_t key);
+
 // create a new empty hashmap
 hashmap_t hashmap_new(usize elt_size);
 // get a pointer to a value in a hashmap, or NULL if not present
 void *hashmap_get(hashmap_t map, str_t key);
+// same as hashmap_get, with the hash of the key already computed
+void *hashmap_get_hashed(hashmap_t map, str_t key, u64 hash);
 // check if a hashmap contains a key
 bool hashmap_contains(hashmap_t map, str_t key);
 // insert a new key and value into a hashmap
@@ -19,8 +24,12 @@ bool hashmap_contains(hashmap_t map, str_t key);
 // return false if the key was already
 // present, and overwrite the previous value
 bool hashmap_insert(hashmap_t map, str_t key, void *value);
+// same as hashmap_insert, with the hash of the key already computed
+bool hashmap_insert_hashed(hashmap_t map, str_t key, u64 hash, void *value);
 // remove a key from a hashmap
 bool hashmap_remove(hashmap_t map, str_t key);
+// same as hashmap_remove, with the hash of the key already computed
+bool hashmap_remove_hashed(hashmap_t map, str_t key, u64 hash);
 // call a function with each key-value pair in the map, with the first parameter
 // indicating the number of keys yet to be visited
 void hashmap_iter(hashmap_t map, void (*lambda)(usize, str_t, void *));
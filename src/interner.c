@@ -1,5 +1,4 @@
-#include <gc/gc.h>
-#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <threads.h>
 
@@ -7,62 +6,159 @@
 #include "interner.h"
 #include "utils.h"
 
+// The interner is split into shards, chosen by the high bits of the hash of
+// strings, each with its own lock. Lookups of strings that are already
+// interned take no lock: entries are immutable, and are published into open
+// addressed tables with release stores. A table that grows is replaced by a
+// new one, so a lookup can only miss an entry that is being inserted, and
+// then retries under the lock.
+#define SHARD_BITS 6
+#define NSHARDS (1ul << SHARD_BITS)
+#define INIT_CAPACITY 64
+
+typedef struct entry {
+  u64 hash;
+  str_t str;
+} entry_t;
+
+typedef struct table {
+  usize cap_mask;
+  _Atomic(entry_t *) slots[];
+} table_t;
+
+typedef struct shard {
+  _Atomic(table_t *) table;
+  // number of entries, only accessed under the lock
+  usize len;
+  mtx_t lock;
+} shard_t;
+
+// the shards are static, so that the collector scans their tables
 static once_flag PRIVATE_INTERNER_INIT = ONCE_FLAG_INIT;
-static mtx_t PRIVATE_INTERNER_LOCK = {0};
-static hashset_t PRIVATE_INTERNER = NULL;
+static shard_t PRIVATE_SHARDS[NSHARDS];
+
+static table_t *table_new(usize cap) {
+  table_t *table = gcalloc(sizeof(table_t) + cap * sizeof(entry_t *));
+  table->cap_mask = cap - 1;
+  for (usize i = 0; i < cap; ++i) {
+    atomic_init(&table->slots[i], NULL);
+  }
+  return table;
+}
 
 static void register_interner() {
-  hashset_t interner = hashset_new();
-  PRIVATE_INTERNER = GC_malloc_uncollectable(hashset_sizeof());
-  if (PRIVATE_INTERNER != NULL) {
-    memcpy(PRIVATE_INTERNER, interner, hashset_sizeof());
-    mtx_init(&PRIVATE_INTERNER_LOCK, mtx_plain);
-  } else {
-    panic("interner allocation failed");
+  for (usize i = 0; i < NSHARDS; ++i) {
+    atomic_init(&PRIVATE_SHARDS[i].table, table_new(INIT_CAPACITY));
+    PRIVATE_SHARDS[i].len = 0;
+    if (mtx_init(&PRIVATE_SHARDS[i].lock, mtx_plain) != thrd_success) {
+      panic("interner allocation failed");
+    }
   }
 }
 
-static inline hashset_t lock() {
+static inline shard_t *shard_of(u64 hash) {
   call_once(&PRIVATE_INTERNER_INIT, register_interner);
-  mtx_lock(&PRIVATE_INTERNER_LOCK);
-  return PRIVATE_INTERNER;
+  return &PRIVATE_SHARDS[hash >> (64 - SHARD_BITS)];
 }
 
-static inline void unlock(hashset_t _) { mtx_unlock(&PRIVATE_INTERNER_LOCK); }
+// find the entry of a string, or the empty slot where it belongs
+static _Atomic(entry_t *) *probe(table_t *table, str_t str, u64 hash,
+                                 entry_t **found) {
+  usize i = hash & table->cap_mask;
+  loop {
+    entry_t *entry =
+        atomic_load_explicit(&table->slots[i], memory_order_acquire);
+    if (entry == NULL || (entry->hash == hash && str_comp(entry->str, str))) {
+      *found = entry;
+      return &table->slots[i];
+    }
+    i = (i + 1) & table->cap_mask;
+  }
+}
 
-str_t intern(str_t str) {
-  hashset_t interner = lock();
+// move the entries of a full table into one twice as large, then publish it
+static table_t *grow(shard_t *shard, table_t *table) {
+  table_t *larger = table_new(2 * (table->cap_mask + 1));
+  for (usize i = 0; i <= table->cap_mask; ++i) {
+    entry_t *entry =
+        atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+    if (entry != NULL) {
+      entry_t *found;
+      _Atomic(entry_t *) *slot =
+          probe(larger, entry->str, entry->hash, &found);
+      atomic_store_explicit(slot, entry, memory_order_relaxed);
+    }
+  }
+  atomic_store_explicit(&shard->table, larger, memory_order_release);
+  return larger;
+}
 
-  str_t res;
-  if (hashset_contains(interner, str)) {
-    res = hashset_get(interner, str);
-  } else {
-    hashset_insert(interner, str);
-    res = str;
+static str_t intern_in(str_t str, bool borrowed) {
+  u64 hash = str_hash(str);
+  shard_t *shard = shard_of(hash);
+
+  entry_t *found;
+  table_t *table = atomic_load_explicit(&shard->table, memory_order_acquire);
+  probe(table, str, hash, &found);
+  if (found != NULL) {
+    return found->str;
   }
 
-  unlock(interner);
-  return res;
+  mtx_lock(&shard->lock);
+  // the table may have grown, or the string been inserted, in the meantime
+  table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+  _Atomic(entry_t *) *slot = probe(table, str, hash, &found);
+  if (found == NULL) {
+    if (2 * (shard->len + 1) > table->cap_mask + 1) {
+      table = grow(shard, table);
+      slot = probe(table, str, hash, &found);
+    }
+    found = gcalloc(sizeof(entry_t));
+    *found = (entry_t){.hash = hash,
+                       .str = borrowed ? str_from(str.data, str.len) : str};
+    atomic_store_explicit(slot, found, memory_order_release);
+    shard->len += 1;
+  }
+  mtx_unlock(&shard->lock);
+  return found->str;
 }
 
-usize interned_strings() {
-  hashset_t interner = lock();
-  usize res = hashset_len(interner);
-  unlock(interner);
-  return res;
+str_t intern(str_t str) { return intern_in(str, false); }
+
+str_t intern_slice(const u8 *data, usize len) {
+  return intern_in(str_make((u8 *)data, len), true);
 }
 
-static void print_str(usize remaining, str_t val) {
-  fdebug_str(stderr, val.data, val.len);
-  if (remaining > 0) {
-    eprint(", ");
+usize interned_strings() {
+  usize len = 0;
+  for (usize i = 0; i < NSHARDS; ++i) {
+    shard_t *shard = shard_of(i << (64 - SHARD_BITS));
+    mtx_lock(&shard->lock);
+    len += shard->len;
+    mtx_unlock(&shard->lock);
   }
+  return len;
 }
 
 void interner_debug() {
   eprint("{");
-  hashset_t interner = lock();
-  hashset_iter(interner, print_str);
-  unlock(interner);
+  bool first = true;
+  for (usize i = 0; i < NSHARDS; ++i) {
+    shard_t *shard = shard_of(i << (64 - SHARD_BITS));
+    mtx_lock(&shard->lock);
+    table_t *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    for (usize j = 0; j <= table->cap_mask; ++j) {
+      entry_t *entry =
+          atomic_load_explicit(&table->slots[j], memory_order_relaxed);
+      if (entry != NULL) {
+        if (!first) {
+          eprint(", ");
+        }
+        fdebug_str(stderr, entry->str.data, entry->str.len);
+        first = false;
+      }
+    }
+    mtx_unlock(&shard->lock);
+  }
   eprint("}");
 }
@@ -3,5 +3,7 @@
 #include "utils.h"
 
 str_t intern(str_t str);
+// intern a string that is only borrowed, and copied if it isn't interned yet
+str_t intern_slice(const u8 *data, usize len);
 usize interned_strings();
 void interner_debug();
@@ -0,0 +1,102 @@
+#include "eval.h"
+#include "jit.h"
+#include "native.h"
+#include "utils.h"
+
+#ifdef MML_JIT
+
+#include <libtcc.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+// symbols of the runtime used by translated code
+static const struct {
+  const char *name;
+  const void *addr;
+} RUNTIME[] = {
+    {"globals", &globals},
+    {"make_int", make_int},
+    {"make_closure", make_closure},
+    {"is_function", is_function},
+    {"tie_knot", tie_knot},
+    {"value_neg", value_neg},
+    {"value_add", value_add},
+    {"value_sub", value_sub},
+    {"value_mul", value_mul},
+    {"value_div", value_div},
+    {"value_eq", value_eq},
+    {"str_eq", str_eq},
+    {"apply", apply},
+    {"native_tail", native_tail},
+    {"native_finish", native_finish},
+    {"native_error", native_error},
+};
+
+// compilation errors only mean that the function stays interpreted
+static void ignore_error(void *opaque, const char *msg) {}
+
+static void *compile(bytes_t source) {
+  TCCState *state = tcc_new();
+  if (state == NULL) {
+    return NULL;
+  }
+  tcc_set_error_func(state, NULL, ignore_error);
+  // the generated code needs nothing from libc
+  tcc_set_options(state, "-nostdlib");
+  tcc_set_output_type(state, TCC_OUTPUT_MEMORY);
+  if (tcc_compile_string(state, (char *)source.data) == -1) {
+    tcc_delete(state);
+    return NULL;
+  }
+  for (usize i = 0; i < sizeof(RUNTIME) / sizeof(RUNTIME[0]); ++i) {
+    tcc_add_symbol(state, RUNTIME[i].name, RUNTIME[i].addr);
+  }
+#ifdef TCC_RELOCATE_AUTO
+  i32 res = tcc_relocate(state, TCC_RELOCATE_AUTO);
+#else
+  i32 res = tcc_relocate(state);
+#endif
+  if (res < 0) {
+    tcc_delete(state);
+    return NULL;
+  }
+  return state;
+}
+
+// libtcc compiles a single program at a time
+static once_flag PRIVATE_JIT_INIT = ONCE_FLAG_INIT;
+static mtx_t PRIVATE_JIT_LOCK;
+
+static void init_jit_lock() { mtx_init(&PRIVATE_JIT_LOCK, mtx_plain); }
+
+// The native code of a function is published with its run function set, so
+// that threads reading it without the lock see a complete one.
+bool jit_hot(vfun_t *fun) {
+  efun_t *code = fun->code;
+  struct native *native =
+      atomic_load_explicit(&code->native, memory_order_acquire);
+  if (native == NULL) {
+    if (code->memo ||
+        atomic_fetch_add_explicit(&fun->calls, 1, memory_order_relaxed) + 1 <
+            JIT_THRESHOLD) {
+      return false;
+    }
+    call_once(&PRIVATE_JIT_INIT, init_jit_lock);
+    mtx_lock(&PRIVATE_JIT_LOCK);
+    // another thread may have compiled it while this one waited
+    native = atomic_load_explicit(&code->native, memory_order_relaxed);
+    if (native == NULL) {
+      native = gcalloc(sizeof(struct native));
+      native->state = compile(translate_fun(code));
+      native->run = NULL;
+      if (native->state != NULL) {
+        native->run = tcc_get_symbol(native->state, "mml_fun");
+      }
+      atomic_store_explicit(&code->native, native, memory_order_release);
+    }
+    mtx_unlock(&PRIVATE_JIT_LOCK);
+  }
+  return native->run != NULL;
+}
+
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#include "eval.h"
+#include "native.h"
+#include "utils.h"
+
+// Tiered compilation: once a closure has been called JIT_THRESHOLD times by
+// the tree walker, the body of its function is translated to C and compiled in
+// memory with libtcc. Calls of any closure of the function then run the native
+// code. The jit is only built with MML_JIT defined (`make JIT=1`), which links
+// against libtcc.
+#define JIT_THRESHOLD 1000
+
+#ifdef MML_JIT
+// count a call of a closure, compiling its function once it is hot. Return
+// whether the body has native code to run.
+bool jit_hot(vfun_t *fun);
+#else
+// without the jit, only functions compiled ahead of time have native code
+static inline bool jit_hot(vfun_t *fun) {
+  return atomic_load_explicit(&fun->code->native, memory_order_acquire) != NULL;
+}
+#endif
@@ -1,6 +1,8 @@
 #include <ctype.h>
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "interner.h"
 #include "lex.h"
@@ -42,12 +44,21 @@
     return mktoken_num(n);                                                     \
   }
 
+#define INT(n)                                                                 \
+  {                                                                            \
+    CONSUME();                                                                 \
+    return mktoken_int(n);                                                     \
+  }
+
 #define STRING(data, len)                                                      \
   {                                                                            \
     CONSUME();                                                                 \
     return mktoken_str(data, len);                                             \
   }
 
+#define SLICE(start, len)                                                      \
+  { return mktoken_slice(__stream, start, len); }
+
 #define IDENT()                                                                \
   {                                                                            \
     if (__stream->seen != 0) {                                                 \
@@ -105,6 +116,44 @@
     }                                                                          \
   }
 
+// classes of the bytes that identifiers start with, and are made of
+#define CC_IDENT_START 1
+#define CC_IDENT 2
+
+static const u8 CHAR_CLASS[256] = {
+    ['a' ... 'z'] = CC_IDENT_START | CC_IDENT,
+    ['A' ... 'Z'] = CC_IDENT_START | CC_IDENT,
+    ['_'] = CC_IDENT_START | CC_IDENT,
+    ['0' ... '9'] = CC_IDENT,
+};
+
+typedef struct keyword {
+  const char *name;
+  usize len;
+  tkind_t kind;
+} keyword_t;
+
+// The keywords, by the sum of their first and last characters modulo 16,
+// which is distinct for each of them. A keyword added must keep it so.
+#define KEYWORD_HASH(data, len) (((data)[0] + (data)[(len)-1]) & 15)
+
+static const keyword_t KEYWORDS[16] = {
+    [0] = {"let", 3, T_LET},     [2] = {"then", 4, T_THEN},
+    [4] = {"fun", 3, T_FUN},     [5] = {"rec", 3, T_REC},
+    [7] = {"in", 2, T_IN},       [9] = {"true", 4, T_TRUE},
+    [10] = {"else", 4, T_ELSE},  [11] = {"false", 5, T_FALSE},
+    [12] = {"memo", 4, T_MEMO},  [15] = {"if", 2, T_IF},
+};
+
+// the keyword that a word is, or NULL for an identifier
+static inline const keyword_t *keyword_of(const u8 *data, usize len) {
+  const keyword_t *keyword = &KEYWORDS[KEYWORD_HASH(data, len)];
+  if (keyword->len == len && memcmp(keyword->name, data, len) == 0) {
+    return keyword;
+  }
+  return NULL;
+}
+
 static inline u8 hexdigit(u8 x) {
   if (x < 16) {
     return (u8)("0123456789abcdef"[x]);
@@ -174,65 +223,78 @@ static token_t mktoken_num(f64 num) {
   return (token_t){.kind = T_NUM, .num = num};
 }
 
+static token_t mktoken_int(i64 integer) {
+  return (token_t){.kind = T_INT, .integer = integer};
+}
+
 static token_t mktoken_str(u8 *data, usize len) {
   str_t str = str_make(data, len);
   return (token_t){.kind = T_STR, .str = intern(str)};
 }
 
+// intern a part of the stream, which is only copied if it isn't retained, and
+// isn't interned yet
+static str_t lex_intern(lexstream_t *stream, usize start, usize len) {
+  if (stream->retained) {
+    return intern(str_make((u8 *)stream->data + start, len));
+  } else {
+    return intern_slice(stream->data + start, len);
+  }
+}
+
+static token_t mktoken_slice(lexstream_t *stream, usize start, usize len) {
+  str_t str = lex_intern(stream, start, len);
+  lex_consume(stream);
+  return (token_t){.kind = T_STR, .str = str};
+}
+
 static token_t mktoken_ident(lexstream_t *stream) {
-  str_t ident = str_from(stream->data, stream->seen);
+  str_t ident = lex_intern(stream, 0, stream->seen);
   lex_consume(stream);
-  return (token_t){.kind = T_IDENT, .ident = intern(ident)};
+  return (token_t){.kind = T_IDENT, .ident = ident};
 }
 
-static LEXER(ident) {
+static LEXER(word) {
   i16 peeked;
   loop {
     peeked = PEEK();
     if (peeked == EOF) {
       INCOMPLETE();
-    } else if ((peeked >= 'a' && peeked <= 'z') ||
-               (peeked >= 'A' && peeked <= 'Z') ||
-               (peeked >= '0' && peeked <= '9') || peeked == '_') {
+    } else if (CHAR_CLASS[peeked] & CC_IDENT) {
       NEXT();
     } else {
-      IDENT();
+      break;
     }
   }
+  const keyword_t *keyword = keyword_of(STREAM()->data, STREAM()->seen);
+  if (keyword != NULL) {
+    TOK(keyword->kind);
+  }
+  IDENT();
 }
 END_LEXER()
 
-static LEXER(keyword, tkind_t kind, const char *keyword) {
-  i16 peeked;
-  usize i;
-  for (i = 0; keyword[i] != 0; ++i) {
-    peeked = PEEK();
-    if (peeked == EOF) {
+static LEXER(string) {
+  // literals without escapes are taken as they are in the input
+  usize start = STREAM()->seen;
+  i16 cur;
+  loop {
+    cur = NEXT();
+    if (cur == EOF) {
       INCOMPLETE();
-    } else if (peeked == keyword[i]) {
-      NEXT();
-    } else {
-      REWIND(i);
-      ERROR("no match");
+    } else if (cur == '"') {
+      SLICE(start, STREAM()->seen - 1 - start);
+    } else if (cur == '\\') {
+      break;
     }
   }
-  peeked = PEEK();
-  if (peeked == EOF) {
-    INCOMPLETE();
-  } else if ((peeked >= 'a' && peeked <= 'z') ||
-             (peeked >= 'A' && peeked <= 'Z') ||
-             (peeked >= '0' && peeked <= '9') || peeked == '_') {
-    REWIND(i);
-    ERROR("no match");
-  } else {
-    TOK(kind);
-  }
-}
-END_LEXER()
-
-static LEXER(string) {
+  REWIND(1);
   bytes_t bytes = bytes_new();
-  i16 cur;
+  if (STREAM()->seen > start) {
+    bytes_reserve(&bytes, STREAM()->seen - start);
+    memcpy(bytes.data, STREAM()->data + start, STREAM()->seen - start);
+    bytes.len = STREAM()->seen - start;
+  }
   loop {
     cur = NEXT();
     switch (cur) {
@@ -428,6 +490,9 @@ LEXER(lex) {
   }
   case '0' ... '9': {
     long double n = LAST() - '0';
+    // literals without a decimal point are integers, unless they overflow
+    i64 integer = LAST() - '0';
+    bool exact = true;
     i16 peeked;
     long double decimals = 0;
     loop {
@@ -439,11 +504,15 @@ LEXER(lex) {
         n *= 10;
         n += peeked - '0';
         decimals /= 10;
+        exact = exact && !__builtin_mul_overflow(integer, 10, &integer) &&
+                !__builtin_add_overflow(integer, peeked - '0', &integer);
       } else if (peeked == '_') {
         NEXT();
       } else if (peeked == '.') {
         NEXT();
         decimals = 1;
+      } else if (decimals == 0 && exact) {
+        INT(integer);
       } else {
         decimals += decimals == 0;
         NUM((f64)(n * decimals));
@@ -451,26 +520,97 @@ LEXER(lex) {
     }
   }
   default:
-    REWIND(1); // rewind by 1 to match on the previous
-               // character in the sub lexers
-    TRY(keyword, T_IN, "in");
-    TRY(keyword, T_IF, "if");
-    TRY(keyword, T_LET, "let");
-    TRY(keyword, T_FUN, "fun");
-    TRY(keyword, T_REC, "rec");
-    TRY(keyword, T_THEN, "then");
-    TRY(keyword, T_ELSE, "else");
-    TRY(keyword, T_TRUE, "true");
-    TRY(keyword, T_FALSE, "false");
-    TRY(ident);
-    NEXT(); // no match; advance again
+    if (CHAR_CLASS[next] & CC_IDENT_START) {
+      CALL(word);
+    }
     ERROR("invalid character");
   }
 }
 END_LEXER()
 
-lexstream_t lexstream_new(const u8 *data, usize len) {
-  return (lexstream_t){.data = data, .len = len, .seen = 0};
+token_t lex_tokens(lexstream_t *stream, tokenbuf_t *tokens) {
+  loop {
+    token_t tok = lex(stream);
+    if (tok.kind == T_INCOMPLETE || tok.kind == T_ERROR) {
+      return tok;
+    }
+    tokenbuf_push(tokens, tok);
+  }
+}
+
+void lex_fail(lexstream_t *stream, token_t tok) {
+  // the results of the toplevels before are not lost
+  fflush(stdout);
+  if (tok.kind == T_ERROR) {
+    fprintf(stderr, "\ninvalid token: ");
+    fdebug_str(stderr, stream->data, stream->seen);
+    eprintln("");
+    panic("malformed token in input stream: %s", tok.error);
+  } else {
+    fprintf(stderr, "\nincomplete token: ");
+    fdebug_str(stderr, stream->data, stream->seen);
+    eprintln("");
+    panic("unfinished token in input stream");
+  }
+}
+
+lexstream_t lexstream_new(const u8 *data, usize len, bool retained) {
+  return (lexstream_t){
+      .data = data, .len = len, .seen = 0, .retained = retained};
+}
+
+tokenreader_t tokenreader_new(FILE *file) {
+  tokenreader_t reader = {
+      .file = file, .mapped = false, .bytes = bytes_new(), .eof = false};
+  usize len;
+  const u8 *data = file_map(file, &len);
+  if (data != NULL) {
+    reader.mapped = true;
+    reader.stream = lexstream_new(data, len, true);
+  } else {
+    bytes_reserve(&reader.bytes, BUFFER_WINDOW);
+    reader.stream = lexstream_new(reader.bytes.data, 0, false);
+  }
+  return reader;
+}
+
+token_t tokenreader_next(tokenreader_t *reader) {
+  loop {
+    token_t tok = lex(&reader->stream);
+    if (tok.kind == T_ERROR) {
+      lex_fail(&reader->stream, tok);
+    } else if (tok.kind != T_INCOMPLETE) {
+      return tok;
+    } else if (reader->eof) {
+      if (reader->stream.seen != 0) {
+        lex_fail(&reader->stream, tok);
+      }
+      return tok;
+    }
+
+    bytes_t *bytes = &reader->bytes;
+    if (reader->mapped) {
+      // the whole file was lexed, but for a token at its very end
+      bytes_reserve(bytes, reader->stream.len + 1);
+      memcpy(bytes->data, reader->stream.data, reader->stream.len);
+      bytes->len = reader->stream.len;
+      bytes_push(bytes, '\n');
+      reader->eof = true;
+    } else {
+      // keep the start of the unfinished token, and read more after it
+      bytes_clear_start(bytes, (usize)(reader->stream.data - bytes->data));
+      bytes_reserve(bytes, BUFFER_WINDOW);
+      fflush(stdout);
+      if (bytes_read(bytes, reader->file) == 0) {
+        // the last token ends before the end of input
+        bytes_push(bytes, '\n');
+        reader->eof = true;
+      }
+    }
+    // the window is reused for the next reads, unlike the copy of the end of
+    // a mapped file
+    reader->stream = lexstream_new(bytes->data, bytes->len, reader->mapped);
+  }
 }
 
 void fprint_token(FILE *f, token_t *tok) {
@@ -484,6 +624,9 @@ void fprint_token(FILE *f, token_t *tok) {
   case T_NUM:
     fprintf(f, "\x1b[33m%.*g\x1b[0m", 16, tok->num);
     break;
+  case T_INT:
+    fprintf(f, "\x1b[33m%" PRId64 "\x1b[0m", tok->integer);
+    break;
   case T_STR:
     fdebug_str_color(f, tok->str.data, tok->str.len);
     break;
@@ -496,6 +639,9 @@ void fprint_token(FILE *f, token_t *tok) {
   case T_REC:
     fprintf(f, "\x1b[035mrec\x1b[0m");
     break;
+  case T_MEMO:
+    fprintf(f, "\x1b[035mmemo\x1b[0m");
+    break;
   case T_FUN:
     fprintf(f, "\x1b[035mfun\x1b[0m");
     break;
@@ -4,14 +4,19 @@
 
 #include "utils.h"
 
+// bytes of input read at a time
+#define BUFFER_WINDOW (1024ul)
+
 typedef enum {
   T_ERROR = -2,
   T_INCOMPLETE = -1,
   T_NUM = 0,
+  T_INT,
   T_STR,
   T_IDENT,
   T_LET,
   T_REC,
+  T_MEMO,
   T_FUN,
   T_IN,
   T_IF,
@@ -36,6 +41,7 @@ typedef struct token {
   tkind_t kind;
   union {
     f64 num;
+    i64 integer;
     str_t str;
     str_t ident;
     const char *error;
@@ -55,10 +61,36 @@ typedef struct {
   const u8 *data;
   usize len;
   usize seen;
+  // whether the data outlives the tokens and is never modified, so that they
+  // can point into it instead of copying it
+  bool retained;
 } lexstream_t;
 
-lexstream_t lexstream_new(const u8 *data, usize len);
+lexstream_t lexstream_new(const u8 *data, usize len, bool retained);
 token_t lex(lexstream_t *stream);
+// Lex tokens from the stream until it runs out of input or holds an invalid
+// token, and return the token lexing stopped at (T_INCOMPLETE or T_ERROR).
+token_t lex_tokens(lexstream_t *stream, tokenbuf_t *tokens);
+// Report the token lexing stopped at, as an invalid or unfinished token.
+void lex_fail(lexstream_t *stream, token_t tok);
 void fprint_token(FILE *f, token_t *tok);
 
 typedef token_t (*lexer_t)(lexstream_t *);
+
+// tokens lexed on demand from a file, mapped in memory if it is a regular
+// file, or read one window at a time
+typedef struct tokenreader {
+  FILE *file;
+  // whether the stream is over the mapping of the whole file
+  bool mapped;
+  bytes_t bytes;
+  lexstream_t stream;
+  bool eof;
+} tokenreader_t;
+
+// The mapping of a file outlives the reader, and the file once closed.
+tokenreader_t tokenreader_new(FILE *file);
+// Lex the next token of the file, reading more of it as needed, or return
+// T_INCOMPLETE at its end. The bytes of the tokens already lexed are dropped
+// from the window, and stdout is flushed before waiting for more input.
+token_t tokenreader_next(tokenreader_t *reader);
@@ -1,89 +1,224 @@
 #include <gc/gc.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ast.h"
 #include "eval.h"
 #include "lex.h"
+#include "native.h"
+#include "optimize.h"
+#include "parallel.h"
+#include "resolve.h"
+#include "typecheck.h"
 #include "utils.h"
-
-#define BUFFER_WINDOW (1024ul)
-
-void run(FILE *file) {
+#include "vm.h"
+
+typedef enum engine {
+  // reference tree-walking evaluator
+  ENGINE_TREE,
+  // bytecode compiler and virtual machine
+  ENGINE_VM,
+  // translation to a standalone C program, written to stdout
+  ENGINE_C,
+} engine_t;
+
+typedef struct options {
+  engine_t engine;
+  // run the optimizer, and print each toplevel after optimization
+  bool optimize;
+  bool dump;
+  // reject ill-typed toplevels before evaluating them
+  bool typecheck;
+  // number of threads lexing and parsing the input, and evaluating toplevels
+  // with the tree walker
+  usize jobs;
+  usize max_depth;
+  const char *path;
+} options_t;
+
+// map the whole input, or read it if it is not a regular file
+static const u8 *read_input(FILE *file, usize *len) {
+  const u8 *data = file_map(file, len);
+  if (data != NULL) {
+    return data;
+  }
   bytes_t bytes = bytes_new();
-  bytes_reserve(&bytes, BUFFER_WINDOW);
-
-  lexstream_t stream;
-  token_t tok;
-  tokenbuf_t tokens = tokenbuf_new();
-  usize read;
-
   loop {
-    read = bytes_fread(&bytes, file);
-    if (read == 0) {
-      bytes_push(&bytes, '\n');
+    bytes_reserve(&bytes, (bytes.cap < BUFFER_WINDOW) ? BUFFER_WINDOW
+                                                      : bytes.cap);
+    if (bytes_fread(&bytes, file) == 0) {
+      *len = bytes.len;
+      return bytes.data;
     }
-    stream = lexstream_new(bytes.data, bytes.len);
-
-    loop {
-      tok = lex(&stream);
-
-      if (tok.kind == T_INCOMPLETE) {
-        if (read == 0 && stream.seen != 0) {
-          fprintf(stderr, "\nincomplete token: ");
-          fdebug_str(stderr, stream.data, stream.seen);
-          eprintln("");
-          panic("unfinished token in input stream");
-        }
-        break;
-      }
+  }
+}
 
-      if (tok.kind == T_ERROR) {
-        fprintf(stderr, "\ninvalid token: ");
-        fdebug_str(stderr, stream.data, stream.seen);
-        eprintln("");
-        panic("malformed token in input stream: %s", tok.error);
-      }
-      tokenbuf_push(&tokens, tok);
-    }
+void run(FILE *file, options_t *options) {
+  // toplevels parsed ahead of evaluation by the parallel front end, or parsed
+  // one at a time as the input is read, each evaluated before the next
+  tokenreader_t reader;
+  parser_t parser;
+  toplevel_t **parsed = NULL;
+  usize nparsed = 0;
+  usize next = 0;
+  if (options->jobs > 1) {
+    usize len;
+    const u8 *input = read_input(file, &len);
+    parsed = parse_parallel(input, len, options->jobs, &nparsed);
+  } else {
+    reader = tokenreader_new(file);
+    parser = parser_stream(&reader);
+  }
 
-    if (read == 0 && tok.kind == T_INCOMPLETE) {
-      break;
+  toplevel_t *tl;
+  optimizer_t optimizer = optimizer_new();
+  resolver_t resolver = resolver_new();
+  typechecker_t typechecker = typechecker_new();
+  vm_t vm = (options->engine == ENGINE_VM) ? vm_new(options->max_depth) : NULL;
+  // toplevels of the program, when it is translated as a whole, or of the
+  // batch evaluated in parallel
+  toplevel_t **tls = NULL;
+  usize ntls = 0;
+  usize tls_cap = 0;
+  do {
+    // closures keep pointers into their toplevel, so it must outlive the loop
+    if (parsed != NULL) {
+      tl = parsed[next++];
+    } else {
+      tl = gcalloc(sizeof(toplevel_t));
+      *tl = toplevel(&parser);
     }
-    bytes_clear_start(&bytes, (usize)(stream.data - bytes.data));
-    if (tok.kind == T_INCOMPLETE) {
-      bytes_reserve(&bytes, BUFFER_WINDOW);
+    if (options->optimize) {
+      optimize_toplevel(&optimizer, tl);
     }
-  }
+    if (options->dump && tl->kind != TL_ERROR) {
+      fprint_toplevel(stdout, tl);
+      println("");
+    }
+    resolve_toplevel(&resolver, tl);
+    if (options->typecheck && !typecheck_toplevel(&typechecker, tl)) {
+      str_t error = typechecker.error;
+      if (options->engine == ENGINE_C) {
+        // an ill-typed program is not translated
+        eprintln("%.*s", (int)(error.len), error.data);
+        exit(1);
+      }
+      // the results of the previous toplevels come first
+      walk_parallel(tls, ntls, options->jobs);
+      ntls = 0;
+      value_t val = make_error(error);
+      print_result(&val);
+      continue;
+    }
+    if (options->engine == ENGINE_VM) {
+      vm_walk_file(vm, tl);
+    } else if (options->engine == ENGINE_TREE && options->jobs == 1) {
+      walk_file(tl);
+    } else {
+      if (ntls == tls_cap) {
+        tls_cap = (tls_cap == 0) ? 64 : 2 * tls_cap;
+        tls = gcrealloc(tls, tls_cap * sizeof(toplevel_t *));
+      }
+      tls[ntls++] = tl;
+    }
+  } while (tl->kind != TL_ERROR &&
+           ((parsed != NULL) ? next < nparsed : !parser_done(&parser)));
 
   if (file != stdin) {
     fclose(file);
   }
 
-  parser_t parser = parser_new(tokens);
-
-  toplevel_t tl;
-  env_t env = NULL;
-  do {
-    tl = toplevel(&parser);
-    env = walk_file(env, &tl);
-  } while (parser.pos < parser.len && tl.kind != TL_ERROR);
+  if (options->engine == ENGINE_TREE) {
+    walk_parallel(tls, ntls, options->jobs);
+  }
 
-  if (tl.kind == TL_ERROR) {
-    error_chain_t error = tl.error;
+  if (tl->kind == TL_ERROR) {
+    error_chain_t error = tl->error;
     while (error.next != NULL) {
       error = *error.next;
-      println("%.*s", (int)(error.msg.len), error.msg.data);
+      if (options->engine == ENGINE_C) {
+        eprintln("%.*s", (int)(error.msg.len), error.msg.data);
+      } else {
+        println("%.*s", (int)(error.msg.len), error.msg.data);
+      }
+    }
+    if (options->engine == ENGINE_C) {
+      // a program that doesn't parse is not translated
+      exit(1);
     }
   }
+  if (options->engine == ENGINE_C) {
+    emit_program(stdout, tls, ntls);
+  }
+}
+
+static void usage(const char *program) {
+  eprintln("usage: %s [--vm | --emit-c] [--no-opt] [--typecheck] [--dump] "
+           "[--max-depth N] [-j N] [FILE]",
+           program);
+  eprintln("  --vm           run with the bytecode virtual machine");
+  eprintln("  --emit-c       print the program as C, to be linked with "
+           "libminiml.a");
+  eprintln("  --no-opt       evaluate toplevels as parsed");
+  eprintln("  --typecheck    infer types, and reject ill-typed toplevels");
+  eprintln("  --dump         print each toplevel before evaluating it");
+  eprintln("  --max-depth N  maximum depth of non-tail calls in the vm");
+  eprintln("  -j N           parse on N threads, and evaluate independent "
+           "toplevels on them with the tree walker");
+  exit(1);
+}
+
+static options_t parse_options(i32 argc, char *argv[]) {
+  options_t options = {.engine = ENGINE_TREE,
+                       .optimize = true,
+                       .dump = false,
+                       .typecheck = false,
+                       .jobs = 1,
+                       .max_depth = VM_MAX_DEPTH,
+                       .path = NULL};
+  for (i32 i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--vm") == 0) {
+      options.engine = ENGINE_VM;
+    } else if (strcmp(argv[i], "--emit-c") == 0) {
+      options.engine = ENGINE_C;
+    } else if (strcmp(argv[i], "--no-opt") == 0) {
+      options.optimize = false;
+    } else if (strcmp(argv[i], "--typecheck") == 0) {
+      options.typecheck = true;
+    } else if (strcmp(argv[i], "--dump") == 0) {
+      options.dump = true;
+    } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+      char *end;
+      options.max_depth = strtoul(argv[++i], &end, 10);
+      if (*end != 0 || options.max_depth == 0) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      char *end;
+      options.jobs = strtoul(argv[++i], &end, 10);
+      if (*end != 0 || options.jobs == 0) {
+        usage(argv[0]);
+      }
+    } else if (argv[i][0] == '-' && argv[i][1] != 0) {
+      usage(argv[0]);
+    } else if (options.path == NULL) {
+      options.path = argv[i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+  return options;
 }
 
 i32 main(i32 argc, char *argv[]) {
+  options_t options = parse_options(argc, argv);
+
   FILE *file;
-  if (argc < 2) {
+  if (options.path == NULL) {
     file = stdin;
   } else {
-    file = fopen(argv[1], "r");
+    file = fopen(options.path, "r");
     if (file == NULL) {
       panic("failed to open file!");
     }
@@ -91,7 +226,7 @@ i32 main(i32 argc, char *argv[]) {
 
   GC_INIT();
 
-  run(file);
+  run(file, &options);
 
   print_memory_use();
 }
@@ -0,0 +1,162 @@
+#include <string.h>
+#include <threads.h>
+
+#include "eval.h"
+#include "hashmap.h"
+#include "memo.h"
+#include "utils.h"
+
+struct memo {
+  hashmap_t results;
+  // keys in insertion order, as a ring buffer. It grows with the cache up to
+  // MEMO_CAPACITY keys, and only wraps around once it stops growing.
+  memo_key_t *keys;
+  usize head;
+  usize len;
+  usize cap;
+};
+
+// room for keys in a new cache
+#define MEMO_INIT_CAPACITY 16
+
+// a single lock for all the caches, which is only held to look up or update
+// one of them, never during the evaluation of a call
+static once_flag PRIVATE_MEMO_INIT = ONCE_FLAG_INIT;
+static mtx_t PRIVATE_MEMO_LOCK;
+
+static void init_lock() { mtx_init(&PRIVATE_MEMO_LOCK, mtx_plain); }
+
+static inline void lock() {
+  call_once(&PRIVATE_MEMO_INIT, init_lock);
+  mtx_lock(&PRIVATE_MEMO_LOCK);
+}
+
+static inline void unlock() { mtx_unlock(&PRIVATE_MEMO_LOCK); }
+
+memo_t memo_of(vfun_t *fun) {
+  lock();
+  if (fun->memo == NULL) {
+    memo_t memo = gcalloc(sizeof(struct memo));
+    memo->results = hashmap_new(sizeof(value_t));
+    memo->keys = NULL;
+    memo->head = 0;
+    memo->len = 0;
+    memo->cap = 0;
+    fun->memo = memo;
+  }
+  unlock();
+  return fun->memo;
+}
+
+static const u64 FNV_BASIS = 0xcbf29ce484222325;
+static const u64 FNV_PRIME = 0x100000001b3;
+
+// mix a word into a hash, fnv-style
+static inline u64 mix(u64 hash, u64 word) { return (hash ^ word) * FNV_PRIME; }
+
+bool memo_key(value_t *args, usize nargs, memo_key_t *key) {
+  usize len = 0;
+  for (usize i = 0; i < nargs; ++i) {
+    switch (value_kind(args[i])) {
+    case V_NUM:
+      len += 1 + sizeof(f64);
+      break;
+    case V_INT:
+      len += 1 + sizeof(i64);
+      break;
+    case V_BOOL:
+      len += 2;
+      break;
+    case V_STR:
+      len += 1 + sizeof(usize) + as_str(args[i]).len;
+      break;
+    default:
+      return false;
+    }
+  }
+
+  // each argument is its kind followed by its contents, strings are prefixed
+  // with their length so that keys are unambiguous
+  u8 *data = gcalloc_atomic(len);
+  u8 *p = data;
+  u64 hash = FNV_BASIS;
+  for (usize i = 0; i < nargs; ++i) {
+    valuekind_t kind = value_kind(args[i]);
+    *p++ = (u8)kind;
+    hash = mix(hash, kind);
+    switch (kind) {
+    case V_NUM: {
+      // 0 and -0 are equal
+      f64 num = as_num(args[i]) + 0.0;
+      memcpy(p, &num, sizeof(f64));
+      p += sizeof(f64);
+      u64 bits;
+      memcpy(&bits, &num, sizeof(f64));
+      hash = mix(hash, bits);
+      break;
+    }
+    case V_INT: {
+      i64 integer = as_int(args[i]);
+      memcpy(p, &integer, sizeof(i64));
+      p += sizeof(i64);
+      hash = mix(hash, (u64)integer);
+      break;
+    }
+    case V_BOOL:
+      *p++ = as_bool(args[i]);
+      hash = mix(hash, as_bool(args[i]));
+      break;
+    case V_STR: {
+      str_t str = as_str(args[i]);
+      memcpy(p, &str.len, sizeof(usize));
+      p += sizeof(usize);
+      memcpy(p, str.data, str.len);
+      p += str.len;
+      hash = mix(hash, str_value_hash(args[i]));
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  // hashmaps use 0 for empty slots
+  if (hash == 0) {
+    hash = 1ul << 63;
+  }
+  *key = (memo_key_t){.str = str_make(data, len), .hash = hash};
+  return true;
+}
+
+bool memo_get(memo_t memo, memo_key_t key, value_t *result) {
+  lock();
+  value_t *cached = hashmap_get_hashed(memo->results, key.str, key.hash);
+  if (cached != NULL) {
+    *result = *cached;
+  }
+  unlock();
+  return cached != NULL;
+}
+
+void memo_insert(memo_t memo, memo_key_t key, value_t value) {
+  lock();
+  if (!hashmap_insert_hashed(memo->results, key.str, key.hash, &value)) {
+    // already cached by a nested call with the same arguments
+    unlock();
+    return;
+  }
+  if (memo->len == MEMO_CAPACITY) {
+    memo_key_t oldest = memo->keys[memo->head];
+    hashmap_remove_hashed(memo->results, oldest.str, oldest.hash);
+    memo->keys[memo->head] = key;
+    memo->head = (memo->head + 1) % MEMO_CAPACITY;
+  } else {
+    // nothing was evicted yet, so the keys start at 0
+    if (memo->len == memo->cap) {
+      memo->cap = (memo->cap == 0) ? MEMO_INIT_CAPACITY : (memo->cap * 2);
+      memo->keys = gcrealloc(memo->keys, memo->cap * sizeof(memo_key_t));
+    }
+    memo->keys[memo->len] = key;
+    memo->len += 1;
+  }
+  unlock();
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "eval.h"
+#include "utils.h"
+
+// maximum number of results cached for a closure
+#define MEMO_CAPACITY (1ul << 16)
+
+struct memo;
+// bounded cache of the results of a memoized closure, keyed by its arguments.
+// When it is full, the oldest entry is evicted.
+typedef struct memo *memo_t;
+
+// cache key: the encoded arguments, and their hash
+typedef struct memo_key {
+  str_t str;
+  u64 hash;
+} memo_key_t;
+
+// get the cache of a memoized closure, creating it on first use. Caches can be
+// used by several threads at once.
+memo_t memo_of(vfun_t *fun);
+// encode arguments as a cache key. Only numbers, strings and booleans can be
+// part of a key: return false if any other argument is present. The hash of
+// the key is made of the hashes of its arguments, which strings cache.
+bool memo_key(value_t *args, usize nargs, memo_key_t *key);
+// get a cached result into result, return false if not present
+bool memo_get(memo_t memo, memo_key_t key, value_t *result);
+// cache a result, evicting the oldest entry if the cache is full
+void memo_insert(memo_t memo, memo_key_t key, value_t value);
@@ -0,0 +1,799 @@
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+
+#include <gc/gc.h>
+
+#include "eval.h"
+#include "hashmap.h"
+#include "native.h"
+#include "utils.h"
+
+// Each thread has its own pending tail call. It is allocated uncollectable, so
+// that the collector scans it, and freed when the thread exits.
+static once_flag PRIVATE_TAIL_CALL_INIT = ONCE_FLAG_INIT;
+static tss_t PRIVATE_TAIL_CALL;
+
+static void init_tail_call() {
+  if (tss_create(&PRIVATE_TAIL_CALL, GC_free) != thrd_success) {
+    panic("failed to create the tail call of threads");
+  }
+}
+
+tail_call_t *native_tail_call() {
+  call_once(&PRIVATE_TAIL_CALL_INIT, init_tail_call);
+  tail_call_t *call = tss_get(PRIVATE_TAIL_CALL);
+  if (call == NULL) {
+    call = GC_malloc_uncollectable(sizeof(tail_call_t));
+    if (call == NULL) {
+      panic("tail call allocation failed");
+    }
+    tss_set(PRIVATE_TAIL_CALL, call);
+  }
+  return call;
+}
+
+value_t native_tail(value_t callee, value_t *args, usize nargs) {
+  tail_call_t *call = native_tail_call();
+  call->callee = callee;
+  call->args = gcalloc(nargs * sizeof(value_t));
+  memcpy(call->args, args, nargs * sizeof(value_t));
+  call->nargs = nargs;
+  return TAIL_CALL;
+}
+
+value_t native_finish() {
+  tail_call_t call = *native_tail_call();
+  return apply(call.callee, call.args, call.nargs);
+}
+
+value_t native_error(const char *msg) {
+  return make_error(str_from((const u8 *)msg, strlen(msg)));
+}
+
+typedef struct translator {
+  // declarations needed by the code, and the code of the functions
+  bytes_t decls;
+  bytes_t out;
+  // function being translated, NULL for a toplevel
+  efun_t *code;
+  // C name of the function being translated
+  const char *name;
+  // number of temporaries declared so far
+  usize temps;
+  // whether the body jumps back to its start, for a self call in tail position
+  bool loops;
+  // whether functions and literals are referred to by name, in a standalone
+  // program, rather than by address
+  bool standalone;
+  // index of each function of a program, keyed by address
+  hashmap_t funs;
+  usize nstrs;
+} translator_t;
+
+// reserve room for more output, at least doubling the buffer when it is full,
+// so that emitting a program takes linear time
+static void reserve_output(bytes_t *out, usize additional) {
+  if (out->len + additional > out->cap) {
+    bytes_reserve(out, (additional > out->len) ? additional : out->len);
+  }
+}
+
+static void vemit_to(bytes_t *out, const char *fmt, va_list args) {
+  va_list copy;
+  va_copy(copy, args);
+  i32 res = vsnprintf(NULL, 0, fmt, copy);
+  va_end(copy);
+  if (res < 0) {
+    panic("failed to format generated code");
+  }
+  usize len = (usize)res;
+  reserve_output(out, len + 1);
+  vsnprintf((char *)&out->data[out->len], len + 1, fmt, args);
+  out->len += len;
+}
+
+static void append(bytes_t *out, bytes_t bytes) {
+  reserve_output(out, bytes.len);
+  if (bytes.len != 0) {
+    memcpy(&out->data[out->len], bytes.data, bytes.len);
+  }
+  out->len += bytes.len;
+}
+
+static void emit(translator_t *t, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vemit_to(&t->out, fmt, args);
+  va_end(args);
+}
+
+static void declare(translator_t *t, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vemit_to(&t->decls, fmt, args);
+  va_end(args);
+}
+
+// Declarations of the runtime and of the value representation, for the jit.
+// The constants and offsets are taken from this build, so that they can't get
+// out of sync. They mirror the inline functions of eval.h, which standalone
+// programs include instead.
+static void emit_jit_prelude(translator_t *t) {
+  declare(t, "typedef unsigned long long u64;\n"
+             "typedef long long i64;\n"
+             "typedef __SIZE_TYPE__ usize;\n"
+             "typedef struct value { u64 bits; } value_t;\n"
+             "typedef struct env { void *closure; value_t values[]; } *env_t;\n"
+             "extern value_t *globals;\n"
+             "value_t make_int(i64);\n"
+             "void *make_closure(void *);\n"
+             "_Bool is_function(value_t);\n"
+             "void tie_knot(value_t, usize);\n"
+             "value_t value_neg(value_t);\n"
+             "value_t value_add(value_t, value_t);\n"
+             "value_t value_sub(value_t, value_t);\n"
+             "value_t value_mul(value_t, value_t);\n"
+             "value_t value_div(value_t, value_t);\n"
+             "value_t value_eq(value_t, value_t);\n"
+             "_Bool str_eq(value_t, value_t);\n"
+             "value_t apply(value_t, value_t *, usize);\n"
+             "value_t native_tail(value_t, value_t *, usize);\n"
+             "value_t native_finish(void);\n"
+             "value_t native_error(const char *);\n");
+  declare(
+      t,
+      "#define NUM_OFFSET %#lxull\n"
+      "#define CANONICAL_NAN %#lxull\n"
+      "#define INT_OFFSET %#lxull\n"
+      "#define SMALL_INT_MIN (%ldll)\n"
+      "#define SMALL_INT_MAX (%ldll)\n"
+      "#define TAG_MASK %luull\n"
+      "#define TAG_FUN %luull\n"
+      "#define TAG_ERROR %luull\n"
+      "#define TAG_BOOL %luull\n"
+      "#define CODE(__fun) (*(void **)((__fun).bits + %lu))\n"
+      "#define CAPTURES(__closure) ((value_t *)((char *)(__closure) + %lu))\n",
+      NUM_OFFSET, CANONICAL_NAN, INT_OFFSET, SMALL_INT_MIN, SMALL_INT_MAX,
+      TAG_MASK, TAG_FUN, TAG_ERROR, TAG_BOOL, offsetof(vfun_t, code),
+      offsetof(vfun_t, captures));
+  declare(t,
+          "static inline int has_tag(value_t v, u64 tag) {\n"
+          "  return v.bits < INT_OFFSET && (v.bits & TAG_MASK) == tag;\n"
+          "}\n"
+          "static inline int is_small_int(value_t v) {\n"
+          "  return (v.bits >> 48) == 1;\n"
+          "}\n"
+          "static inline i64 as_small_int(value_t v) {\n"
+          "  return (i64)(v.bits - INT_OFFSET) + SMALL_INT_MIN;\n"
+          "}\n"
+          "static inline value_t value_int(i64 i) {\n"
+          "  if (i < SMALL_INT_MIN || i > SMALL_INT_MAX) {\n"
+          "    return make_int(i);\n"
+          "  }\n"
+          "  return (value_t){INT_OFFSET + (u64)(i - SMALL_INT_MIN)};\n"
+          "}\n"
+          "static inline int is_num(value_t v) { return v.bits >= NUM_OFFSET; "
+          "}\n"
+          "static inline double as_num(value_t v) {\n"
+          "  union { u64 bits; double num; } u = {v.bits - NUM_OFFSET};\n"
+          "  return u.num;\n"
+          "}\n"
+          "static inline value_t value_num(double num) {\n"
+          "  union { double num; u64 bits; } u = {num};\n"
+          "  if (num != num) {\n"
+          "    u.bits = CANONICAL_NAN;\n"
+          "  }\n"
+          "  return (value_t){u.bits + NUM_OFFSET};\n"
+          "}\n"
+          "static inline value_t value_bool(int b) {\n"
+          "  return (value_t){TAG_BOOL | ((u64)(b != 0) << 3)};\n"
+          "}\n"
+          "static inline int is_bool(value_t v) { return has_tag(v, "
+          "TAG_BOOL); }\n"
+          "static inline int as_bool(value_t v) { return (v.bits >> 3) != 0; "
+          "}\n"
+          "static inline int is_error(value_t v) { return has_tag(v, "
+          "TAG_ERROR); }\n"
+          "static inline int is_fun(value_t v) {\n"
+          "  return v.bits != 0 && has_tag(v, TAG_FUN);\n"
+          "}\n"
+          "static inline int is_tail_call(value_t v) {\n"
+          "  return v.bits == TAG_ERROR;\n"
+          "}\n");
+}
+
+// helpers of the translated code that are not part of eval.h
+static void emit_common_prelude(translator_t *t) {
+  declare(t,
+          // small integers multiply without overflow when they fit in 32 bits
+          "static inline int is_short_int(value_t v) {\n"
+          "  i64 i = as_small_int(v);\n"
+          "  return is_small_int(v) && i > -(1ll << 31) && i < (1ll << 31);\n"
+          "}\n"
+          "#define BUBBLE(__v) if (is_error(__v)) { return __v; }\n");
+}
+
+// reference to the code of a function, compared to the code of closures
+static void emit_code_ref(translator_t *t, efun_t *code) {
+  if (t->standalone) {
+    usize *index = hashmap_get(t->funs, str_make((u8 *)&code, sizeof(code)));
+    emit(t, "&code_%lu", *index);
+  } else {
+    emit(t, "(void *)%#lx", (usize)code);
+  }
+}
+
+// declare a new temporary, whose value is written next
+static usize new_temp(translator_t *t) {
+  usize temp = t->temps++;
+  emit(t, "value_t t%lu = ", temp);
+  return temp;
+}
+
+static usize gen_error(translator_t *t, const char *msg) {
+  usize temp = new_temp(t);
+  emit(t, "native_error(\"%s\");\nreturn t%lu;\n", msg, temp);
+  return temp;
+}
+
+// the binding at the lexical address of a variable, which must be bound
+static void emit_var(translator_t *t, evar_t *var) {
+  switch (var->scope) {
+  case VAR_LOCAL:
+    emit(t, "env->values[%lu]", var->slot);
+    break;
+  case VAR_CAPTURED:
+    emit(t, "CAPTURES(env->closure)[%lu]", var->slot);
+    break;
+  case VAR_GLOBAL:
+    emit(t, "globals[%lu]", var->slot);
+    break;
+  case VAR_UNBOUND:
+    break;
+  }
+}
+
+static usize gen_expr(translator_t *t, expr_t *e);
+
+// a C literal with the contents of a string
+static void declare_str_data(translator_t *t, str_t str) {
+  declare(t, "\"");
+  for (usize i = 0; i < str.len; ++i) {
+    u8 c = str.data[i];
+    if (c == '"' || c == '\\' || c == '?' || c < ' ' || c > '~') {
+      declare(t, "\\%03o", c);
+    } else {
+      declare(t, "%c", c);
+    }
+  }
+  declare(t, "\"");
+}
+
+static usize gen_str(translator_t *t, expr_t *e) {
+  if (!t->standalone) {
+    usize temp = new_temp(t);
+    emit(t, "(value_t){%#lxull};\n", value_str(&e->str).bits);
+    return temp;
+  }
+  usize index = t->nstrs++;
+  declare(t, "static vstr_t str_%lu = {.str = {.len = %lu, .data = (u8 *)",
+          index, e->str.len);
+  declare_str_data(t, e->str);
+  declare(t, "}, .hash = 0};\n");
+  usize temp = new_temp(t);
+  emit(t, "value_str(&str_%lu.str);\n", index);
+  return temp;
+}
+
+static usize gen_var(translator_t *t, expr_t *e) {
+  if (e->var.scope == VAR_UNBOUND) {
+    return gen_error(t, "unknown binding");
+  }
+  usize temp = new_temp(t);
+  emit_var(t, &e->var);
+  emit(t, ";\nBUBBLE(t%lu);\n", temp);
+  return temp;
+}
+
+// arithmetic on small integers and floats, with the primitive as fallback
+static usize gen_binop(translator_t *t, expr_t *e) {
+  usize l = gen_expr(t, e->binop.lhs);
+  usize r = gen_expr(t, e->binop.rhs);
+  usize temp = t->temps++;
+  emit(t, "value_t t%lu;\n", temp);
+  const char *op = NULL;
+  const char *prim = NULL;
+  bool compare = false;
+  switch (e->kind) {
+  case E_ADD:
+  case E_ADD_NUM:
+  case E_ADD_INT:
+    op = "+";
+    prim = "value_add";
+    emit(t, "if (is_small_int(t%lu) && is_small_int(t%lu)) {\n", l, r);
+    emit(t, "t%lu = value_int(as_small_int(t%lu) + as_small_int(t%lu));\n",
+         temp, l, r);
+    break;
+  case E_SUB:
+  case E_SUB_NUM:
+  case E_SUB_INT:
+    op = "-";
+    prim = "value_sub";
+    emit(t, "if (is_small_int(t%lu) && is_small_int(t%lu)) {\n", l, r);
+    emit(t, "t%lu = value_int(as_small_int(t%lu) - as_small_int(t%lu));\n",
+         temp, l, r);
+    break;
+  case E_MUL:
+  case E_MUL_NUM:
+  case E_MUL_INT:
+    op = "*";
+    prim = "value_mul";
+    emit(t, "if (is_short_int(t%lu) && is_short_int(t%lu)) {\n", l, r);
+    emit(t, "t%lu = value_int(as_small_int(t%lu) * as_small_int(t%lu));\n",
+         temp, l, r);
+    break;
+  case E_EQ:
+  case E_EQ_NUM:
+  case E_EQ_INT:
+    op = "==";
+    prim = "value_eq";
+    compare = true;
+    emit(t, "if (is_small_int(t%lu) && is_small_int(t%lu)) {\n", l, r);
+    emit(t, "t%lu = value_bool(t%lu.bits == t%lu.bits);\n", temp, l, r);
+    break;
+  case E_ADD_STR:
+    // strings, as proven by the type checker: the addition cannot fail
+    emit(t, "t%lu = value_add(t%lu, t%lu);\n", temp, l, r);
+    return temp;
+  case E_EQ_STR:
+    emit(t, "t%lu = value_bool(str_eq(t%lu, t%lu));\n", temp, l, r);
+    return temp;
+  default:
+    // division has no fast path
+    emit(t, "t%lu = value_div(t%lu, t%lu);\nBUBBLE(t%lu);\n", temp, l, r,
+         temp);
+    return temp;
+  }
+  emit(t, "} else if (is_num(t%lu) && is_num(t%lu)) {\n", l, r);
+  emit(t, "t%lu = value_%s(as_num(t%lu) %s as_num(t%lu));\n", temp,
+       compare ? "bool" : "num", l, op, r);
+  emit(t, "} else {\nt%lu = %s(t%lu, t%lu);\nBUBBLE(t%lu);\n}\n", temp, prim,
+       l, r, temp);
+  return temp;
+}
+
+// evaluate the arguments of a call into an array, after its callee
+static usize gen_args(translator_t *t, ecall_t *call) {
+  usize *temps = gcalloc(call->nargs * sizeof(usize));
+  for (usize i = 0; i < call->nargs; ++i) {
+    temps[i] = gen_expr(t, &call->args[i]);
+  }
+  usize args = t->temps++;
+  emit(t, "value_t t%lu[%lu] = {", args, call->nargs > 0 ? call->nargs : 1);
+  for (usize i = 0; i < call->nargs; ++i) {
+    emit(t, "%st%lu", i > 0 ? ", " : "", temps[i]);
+  }
+  emit(t, "};\n");
+  return args;
+}
+
+// Whether a call may be a saturated call of the function being translated,
+// whose native code can be called directly. Memoized functions go through
+// their cache instead.
+static bool may_recurse(translator_t *t, ecall_t *call) {
+  return t->code != NULL && !t->code->memo && call->nargs == t->code->arity;
+}
+
+// test that a callee is a closure of the function being translated
+static void emit_is_self(translator_t *t, usize callee) {
+  emit(t, "if (is_fun(t%lu) && CODE(t%lu) == ", callee, callee);
+  emit_code_ref(t, t->code);
+  emit(t, ") {\n");
+}
+
+// Calls of the function being translated run its native code directly, in a
+// frame on the C stack. Other calls go through apply.
+static usize gen_call(translator_t *t, expr_t *e) {
+  usize callee = gen_expr(t, e->call.callee);
+  usize args = gen_args(t, &e->call);
+  usize temp = t->temps++;
+  emit(t, "value_t t%lu;\n", temp);
+  if (may_recurse(t, &e->call)) {
+    emit_is_self(t, callee);
+    emit(t,
+         "struct { void *closure; value_t values[%lu]; } frame = {0};\n"
+         "frame.closure = (void *)t%lu.bits;\n",
+         t->code->frame_size > 0 ? t->code->frame_size : 1, callee);
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      emit(t, "frame.values[%lu] = t%lu[%lu];\n", i, args, i);
+    }
+    emit(t,
+         "t%lu = %s((env_t)&frame);\n"
+         "if (is_tail_call(t%lu)) {\n"
+         "t%lu = native_finish();\n"
+         "}\n"
+         "} else {\n",
+         temp, t->name, temp, temp);
+  } else {
+    emit(t, "{\n");
+  }
+  emit(t, "t%lu = apply(t%lu, t%lu, %lu);\n}\nBUBBLE(t%lu);\n", temp, callee,
+       args, e->call.nargs, temp);
+  return temp;
+}
+
+static usize gen_fun(translator_t *t, expr_t *e) {
+  efun_t *code = &e->fun;
+  usize fun = t->temps++;
+  emit(t, "void *f%lu = make_closure(", fun);
+  emit_code_ref(t, code);
+  emit(t, ");\n");
+  for (usize i = 0; i < code->ncaptures; ++i) {
+    if (code->captures[i].scope == VAR_UNBOUND) {
+      continue;
+    }
+    emit(t, "CAPTURES(f%lu)[%lu] = ", fun, i);
+    emit_var(t, &code->captures[i]);
+    emit(t, ";\n");
+  }
+  usize temp = new_temp(t);
+  emit(t, "(value_t){(u64)(usize)f%lu | TAG_FUN};\n", fun);
+  return temp;
+}
+
+// bind the value of a let or let rec, before its body
+static void gen_binding(translator_t *t, expr_t *e) {
+  usize value = gen_expr(t, e->let.expr);
+  if (e->kind == E_LETREC) {
+    emit(t,
+         "if (!is_function(t%lu)) {\n"
+         "return native_error(\"let rec binding can only be used with a "
+         "function\");\n"
+         "}\n",
+         value);
+  }
+  emit(t, "env->values[%lu] = t%lu;\n", e->let.slot, value);
+  if (e->kind == E_LETREC && is_local_closure(e->let.expr)) {
+    emit(t, "tie_knot(t%lu, %lu);\n", value, e->let.slot);
+  }
+}
+
+static usize gen_ifthen(translator_t *t, expr_t *e) {
+  usize cond = gen_expr(t, e->ifthen.cond);
+  usize temp = t->temps++;
+  emit(t,
+       "if (!is_bool(t%lu)) {\n"
+       "return native_error(\"condition is not a boolean\");\n"
+       "}\n"
+       "value_t t%lu;\n"
+       "if (as_bool(t%lu)) {\n",
+       cond, temp, cond);
+  emit(t, "t%lu = t%lu;\n} else {\n", temp, gen_expr(t, e->ifthen.then_body));
+  emit(t, "t%lu = t%lu;\n}\n", temp, gen_expr(t, e->ifthen.else_body));
+  return temp;
+}
+
+// generate the statements evaluating an expression into a new temporary
+static usize gen_expr(translator_t *t, expr_t *e) {
+  usize temp;
+  switch (e->kind) {
+  case E_NUM:
+    temp = new_temp(t);
+    emit(t, "(value_t){%#lxull};\n", value_num(e->num).bits);
+    return temp;
+  case E_INT:
+    temp = new_temp(t);
+    if (e->integer == INT64_MIN) {
+      // the literal of its absolute value would overflow
+      emit(t, "value_int(-%" PRId64 "ll - 1);\n", INT64_MAX);
+    } else {
+      emit(t, "value_int(%" PRId64 "ll);\n", e->integer);
+    }
+    return temp;
+  case E_STR:
+    return gen_str(t, e);
+  case E_BOOL:
+    temp = new_temp(t);
+    emit(t, "(value_t){%#lxull};\n", value_bool(e->boolean).bits);
+    return temp;
+  case E_UNIT:
+    temp = new_temp(t);
+    emit(t, "(value_t){0};\n");
+    return temp;
+  case E_VAR:
+    return gen_var(t, e);
+  case E_CALL:
+  case E_CALL_FUN:
+    return gen_call(t, e);
+  case E_LET:
+  case E_LETREC:
+    gen_binding(t, e);
+    return gen_expr(t, e->let.body);
+  case E_FUN:
+    return gen_fun(t, e);
+  case E_IFTHEN:
+    return gen_ifthen(t, e);
+  case E_NEG: {
+    usize rhs = gen_expr(t, e->unop.rhs);
+    temp = new_temp(t);
+    emit(t, "value_neg(t%lu);\nBUBBLE(t%lu);\n", rhs, temp);
+    return temp;
+  }
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR:
+    return gen_binop(t, e);
+  case E_ERROR:
+  case E_NOMATCH:
+    return gen_error(t, "invalid expression");
+  }
+  return gen_error(t, "unreachable");
+}
+
+// Generate the statements evaluating an expression in tail position, which
+// return its value. A call of the function being translated reuses the frame
+// and jumps back to the start, other calls are left to the caller.
+static void gen_tail(translator_t *t, expr_t *e) {
+  switch (e->kind) {
+  case E_LET:
+  case E_LETREC:
+    gen_binding(t, e);
+    gen_tail(t, e->let.body);
+    return;
+  case E_IFTHEN: {
+    usize cond = gen_expr(t, e->ifthen.cond);
+    emit(t,
+         "if (!is_bool(t%lu)) {\n"
+         "return native_error(\"condition is not a boolean\");\n"
+         "}\n"
+         "if (as_bool(t%lu)) {\n",
+         cond, cond);
+    gen_tail(t, e->ifthen.then_body);
+    emit(t, "} else {\n");
+    gen_tail(t, e->ifthen.else_body);
+    emit(t, "}\n");
+    return;
+  }
+  case E_CALL:
+  case E_CALL_FUN: {
+    usize callee = gen_expr(t, e->call.callee);
+    usize args = gen_args(t, &e->call);
+    if (may_recurse(t, &e->call)) {
+      emit_is_self(t, callee);
+      emit(t, "env->closure = (void *)t%lu.bits;\n", callee);
+      for (usize i = 0; i < e->call.nargs; ++i) {
+        emit(t, "env->values[%lu] = t%lu[%lu];\n", i, args, i);
+      }
+      emit(t, "goto start;\n}\n");
+      t->loops = true;
+    }
+    emit(t, "return native_tail(t%lu, t%lu, %lu);\n", callee, args,
+         e->call.nargs);
+    return;
+  }
+  default:
+    emit(t, "return t%lu;\n", gen_expr(t, e));
+    return;
+  }
+}
+
+// a C function running a body in the frame of a call
+static void gen_body(translator_t *t, const char *name, efun_t *code,
+                     expr_t *body) {
+  t->code = code;
+  t->name = name;
+  t->temps = 0;
+  t->loops = false;
+  // the body is generated first, to know whether it needs the label
+  bytes_t before = t->out;
+  t->out = bytes_new();
+  gen_tail(t, body);
+  bytes_t statements = t->out;
+  t->out = before;
+  emit(t, "%svalue_t %s(env_t env) {\n%s", t->standalone ? "static " : "",
+       name, t->loops ? "start:;\n" : "");
+  append(&t->out, statements);
+  emit(t, "}\n");
+}
+
+bytes_t translate_fun(efun_t *code) {
+  translator_t t = {.decls = bytes_new(),
+                    .out = bytes_new(),
+                    .standalone = false,
+                    .funs = NULL,
+                    .nstrs = 0};
+  emit_jit_prelude(&t);
+  emit_common_prelude(&t);
+  gen_body(&t, "mml_fun", code, code->body);
+  bytes_t source = t.decls;
+  append(&source, t.out);
+  bytes_push(&source, 0);
+  return source;
+}
+
+// every function of an expression, in the order of their nodes
+static void collect_funs(expr_t *e, efun_t ***funs, usize *len, usize *cap) {
+  switch (e->kind) {
+  case E_CALL:
+  case E_CALL_FUN:
+    collect_funs(e->call.callee, funs, len, cap);
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      collect_funs(&e->call.args[i], funs, len, cap);
+    }
+    return;
+  case E_LET:
+  case E_LETREC:
+    collect_funs(e->let.expr, funs, len, cap);
+    collect_funs(e->let.body, funs, len, cap);
+    return;
+  case E_FUN:
+    if (*len == *cap) {
+      *cap = (*cap == 0) ? 16 : 2 * *cap;
+      *funs = gcrealloc(*funs, *cap * sizeof(efun_t *));
+    }
+    (*funs)[(*len)++] = &e->fun;
+    collect_funs(e->fun.body, funs, len, cap);
+    return;
+  case E_IFTHEN:
+    collect_funs(e->ifthen.cond, funs, len, cap);
+    collect_funs(e->ifthen.then_body, funs, len, cap);
+    collect_funs(e->ifthen.else_body, funs, len, cap);
+    return;
+  case E_NEG:
+    collect_funs(e->unop.rhs, funs, len, cap);
+    return;
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR:
+    collect_funs(e->binop.lhs, funs, len, cap);
+    collect_funs(e->binop.rhs, funs, len, cap);
+    return;
+  default:
+    return;
+  }
+}
+
+static const char *SCOPES[] = {
+    [VAR_UNBOUND] = "VAR_UNBOUND",
+    [VAR_LOCAL] = "VAR_LOCAL",
+    [VAR_CAPTURED] = "VAR_CAPTURED",
+    [VAR_GLOBAL] = "VAR_GLOBAL",
+};
+
+// the code of a function as a static efun_t, whose body is never interpreted
+static void declare_fun(translator_t *t, usize index, efun_t *code) {
+  declare(t,
+          "static value_t fun_%lu(env_t env);\n"
+          "static struct native native_%lu = {.run = fun_%lu, .state = "
+          "NULL};\n",
+          index, index, index);
+  if (code->ncaptures > 0) {
+    declare(t, "static evar_t captures_%lu[] = {", index);
+    for (usize i = 0; i < code->ncaptures; ++i) {
+      declare(t, "%s{.scope = %s, .slot = %lu}", i > 0 ? ", " : "",
+              SCOPES[code->captures[i].scope], code->captures[i].slot);
+    }
+    declare(t, "};\n");
+  }
+  declare(t, "static efun_t code_%lu = {.arity = %lu, .frame_size = %lu, ",
+          index, code->arity, code->frame_size);
+  if (code->ncaptures > 0) {
+    declare(t, ".ncaptures = %lu, .captures = captures_%lu, ",
+            code->ncaptures, index);
+  }
+  declare(t, ".memo = %s, .native = &native_%lu};\n",
+          code->memo ? "true" : "false", index);
+}
+
+void emit_program(FILE *f, toplevel_t **tls, usize len) {
+  translator_t t = {.decls = bytes_new(),
+                    .out = bytes_new(),
+                    .standalone = true,
+                    .funs = hashmap_new(sizeof(usize)),
+                    .nstrs = 0};
+  declare(&t, "#include <gc/gc.h>\n"
+              "\n"
+              "#include \"eval.h\"\n"
+              "#include \"native.h\"\n"
+              "\n"
+              "#define CODE(__fun) ((void *)as_fun(__fun)->code)\n"
+              "#define CAPTURES(__closure) (((vfun_t *)(__closure))->captures)"
+              "\n");
+  emit_common_prelude(&t);
+
+  efun_t **funs = NULL;
+  usize nfuns = 0;
+  usize cap = 0;
+  for (usize i = 0; i < len; ++i) {
+    switch (tls[i]->kind) {
+    case TL_EXPR:
+      collect_funs(&tls[i]->expr, &funs, &nfuns, &cap);
+      break;
+    case TL_LET:
+    case TL_LETREC:
+      collect_funs(&tls[i]->let.expr, &funs, &nfuns, &cap);
+      break;
+    case TL_ERROR:
+      break;
+    }
+  }
+  for (usize i = 0; i < nfuns; ++i) {
+    efun_t **key = gcalloc(sizeof(efun_t *));
+    *key = funs[i];
+    hashmap_insert(t.funs, str_make((u8 *)key, sizeof(efun_t *)), &i);
+    declare_fun(&t, i, funs[i]);
+  }
+
+  char name[64];
+  for (usize i = 0; i < nfuns; ++i) {
+    snprintf(name, sizeof(name), "fun_%lu", i);
+    gen_body(&t, name, funs[i], funs[i]->body);
+  }
+  for (usize i = 0; i < len; ++i) {
+    snprintf(name, sizeof(name), "toplevel_%lu", i);
+    switch (tls[i]->kind) {
+    case TL_EXPR:
+      gen_body(&t, name, NULL, &tls[i]->expr);
+      break;
+    case TL_LET:
+    case TL_LETREC:
+      gen_body(&t, name, NULL, &tls[i]->let.expr);
+      break;
+    case TL_ERROR:
+      break;
+    }
+  }
+
+  emit(&t, "int main() {\nGC_INIT();\nvalue_t result;\n");
+  for (usize i = 0; i < len; ++i) {
+    if (tls[i]->kind == TL_ERROR) {
+      continue;
+    }
+    if (tls[i]->kind != TL_EXPR) {
+      emit(&t, "globals_reserve(%lu);\n", tls[i]->let.global + 1);
+    }
+    emit(&t,
+         "result = toplevel_%lu(push_env(NULL, %lu));\n"
+         "if (is_tail_call(result)) {\n"
+         "result = native_finish();\n"
+         "}\n",
+         i, tls[i]->frame_size);
+    if (tls[i]->kind == TL_EXPR) {
+      emit(&t, "print_result(&result);\n");
+    } else {
+      emit(&t, "globals[%lu] = result;\n", tls[i]->let.global);
+    }
+  }
+  emit(&t, "return 0;\n}\n");
+
+  fwrite(t.decls.data, 1, t.decls.len, f);
+  fwrite(t.out.data, 1, t.out.len, f);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "ast.h"
+#include "eval.h"
+#include "utils.h"
+
+// Native code: function bodies translated to C, either compiled in memory by
+// the jit or written out with the rest of the program by --emit-c. A
+// translated body runs in a frame of a call, laid out like the frames of the
+// tree walker, and keeps values NaN-boxed.
+
+// native code of the body of a function
+struct native {
+  // run the body in a frame of a call, or NULL if it could not be compiled
+  value_t (*run)(env_t frame);
+  // libtcc state owning the code, for the jit
+  void *state;
+};
+
+// Native code doesn't make calls in tail position to other functions: it
+// returns TAIL_CALL instead, leaving the call in native_tail_call to its
+// caller, so that chains of tail calls don't grow the C stack.
+#define TAIL_CALL ((value_t){.bits = TAG_ERROR})
+
+typedef struct tail_call {
+  value_t callee;
+  value_t *args;
+  usize nargs;
+} tail_call_t;
+
+// the call left by the native code running on the current thread
+tail_call_t *native_tail_call();
+
+static inline bool is_tail_call(value_t val) {
+  return val.bits == TAIL_CALL.bits;
+}
+
+// runtime functions called by native code: leave a call in tail position to
+// the caller, make such a call, and create an error value
+value_t native_tail(value_t callee, value_t *args, usize nargs);
+value_t native_finish();
+value_t native_error(const char *msg);
+
+// Translate the body of a function to C, as a function named mml_fun. The
+// function and its literals are referred to by address, so the code is only
+// valid in this process.
+bytes_t translate_fun(efun_t *code);
+// Write a resolved program as a standalone C program, to be linked with the
+// runtime (libminiml.a) and libgc. It runs the toplevels like walk_file.
+void emit_program(FILE *f, toplevel_t **tls, usize len);
@@ -0,0 +1,734 @@
+#include "optimize.h"
+#include "ast.h"
+#include "eval.h"
+#include "utils.h"
+
+#include <stdio.h>
+
+// maximum number of nodes in the body of a function inlined at call sites
+#define INLINE_LIMIT 24
+
+// local names in scope, innermost first: the enclosing lets and functions of
+// the toplevel
+typedef struct names {
+  str_t name;
+  // the value is never an error, so reading it can't fail. Errors in local
+  // bindings are propagated before their body runs.
+  bool pure;
+  // function literal of a non-recursive binding, if it can be inlined
+  expr_t *fun;
+  struct names *next;
+} names_t;
+
+static names_t *bind(names_t *names, str_t name, bool pure, expr_t *fun) {
+  names_t *inner = gcalloc(sizeof(names_t));
+  inner->name = name;
+  inner->pure = pure;
+  inner->fun = fun;
+  inner->next = names;
+  return inner;
+}
+
+static names_t *lookup(names_t *names, str_t name) {
+  for (; names != NULL; names = names->next) {
+    if (str_comp(names->name, name)) {
+      return names;
+    }
+  }
+  return NULL;
+}
+
+// binding of a previous toplevel
+typedef struct global {
+  // position of the binding among the toplevel bindings
+  usize index;
+  // unlike local bindings, a toplevel binding keeps the error it evaluated to
+  bool pure;
+  expr_t *fun;
+} global_t;
+
+optimizer_t optimizer_new() {
+  return (optimizer_t){
+      .globals = hashmap_new(sizeof(global_t)), .nglobals = 0, .fresh = 0};
+}
+
+static void bind_global(optimizer_t *optimizer, str_t name, bool pure,
+                        expr_t *fun) {
+  global_t global = {.index = optimizer->nglobals, .pure = pure, .fun = fun};
+  optimizer->nglobals += 1;
+  hashmap_insert(optimizer->globals, name, &global);
+}
+
+static bool is_literal(expr_t *e) {
+  switch (e->kind) {
+  case E_NUM:
+  case E_INT:
+  case E_STR:
+  case E_BOOL:
+  case E_UNIT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// evaluating the expression has no effect, and can't fail
+static bool is_pure(optimizer_t *optimizer, names_t *names, expr_t *e) {
+  if (e->kind == E_VAR) {
+    names_t *binding = lookup(names, e->var.name);
+    if (binding != NULL) {
+      return binding->pure;
+    }
+    global_t *global = hashmap_get(optimizer->globals, e->var.name);
+    return global != NULL && global->pure;
+  }
+  return is_literal(e) || e->kind == E_FUN;
+}
+
+static value_t literal_value(expr_t *e) {
+  switch (e->kind) {
+  case E_NUM:
+    return value_num(e->num);
+  case E_INT:
+    return value_int(e->integer);
+  case E_STR:
+    return value_str(&e->str);
+  case E_BOOL:
+    return value_bool(e->boolean);
+  default:
+    return UNIT;
+  }
+}
+
+// replace an expression by the literal for a value, if there is one
+static bool fold(expr_t *e, value_t val) {
+  switch (value_kind(val)) {
+  case V_NUM:
+    *e = (expr_t){.kind = E_NUM, .num = as_num(val)};
+    return true;
+  case V_INT:
+    *e = (expr_t){.kind = E_INT, .integer = as_int(val)};
+    return true;
+  case V_STR:
+    *e = (expr_t){.kind = E_STR, .str = as_str(val)};
+    return true;
+  case V_BOOL:
+    *e = (expr_t){.kind = E_BOOL, .boolean = as_bool(val)};
+    return true;
+  case V_UNIT:
+    *e = (expr_t){.kind = E_UNIT};
+    return true;
+  default:
+    // errors are left to be reported at runtime
+    return false;
+  }
+}
+
+static bool occurs_free(expr_t *e, str_t name) {
+  switch (e->kind) {
+  case E_VAR:
+    return str_comp(e->var.name, name);
+  case E_CALL:
+  case E_CALL_FUN:
+    if (occurs_free(e->call.callee, name)) {
+      return true;
+    }
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      if (occurs_free(&e->call.args[i], name)) {
+        return true;
+      }
+    }
+    return false;
+  case E_LET:
+    return occurs_free(e->let.expr, name) ||
+           (!str_comp(e->let.name, name) && occurs_free(e->let.body, name));
+  case E_LETREC:
+    return !str_comp(e->let.name, name) &&
+           (occurs_free(e->let.expr, name) || occurs_free(e->let.body, name));
+  case E_FUN:
+    for (usize i = 0; i < e->fun.arity; ++i) {
+      if (str_comp(e->fun.params[i], name)) {
+        return false;
+      }
+    }
+    return occurs_free(e->fun.body, name);
+  case E_IFTHEN:
+    return occurs_free(e->ifthen.cond, name) ||
+           occurs_free(e->ifthen.then_body, name) ||
+           occurs_free(e->ifthen.else_body, name);
+  case E_NEG:
+    return occurs_free(e->unop.rhs, name);
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR:
+    return occurs_free(e->binop.lhs, name) || occurs_free(e->binop.rhs, name);
+  default:
+    return false;
+  }
+}
+
+// whether a name is bound anywhere inside an expression
+static bool binds(expr_t *e, str_t name) {
+  switch (e->kind) {
+  case E_CALL:
+  case E_CALL_FUN:
+    if (binds(e->call.callee, name)) {
+      return true;
+    }
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      if (binds(&e->call.args[i], name)) {
+        return true;
+      }
+    }
+    return false;
+  case E_LET:
+  case E_LETREC:
+    return str_comp(e->let.name, name) || binds(e->let.expr, name) ||
+           binds(e->let.body, name);
+  case E_FUN:
+    for (usize i = 0; i < e->fun.arity; ++i) {
+      if (str_comp(e->fun.params[i], name)) {
+        return true;
+      }
+    }
+    return binds(e->fun.body, name);
+  case E_IFTHEN:
+    return binds(e->ifthen.cond, name) || binds(e->ifthen.then_body, name) ||
+           binds(e->ifthen.else_body, name);
+  case E_NEG:
+    return binds(e->unop.rhs, name);
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR:
+    return binds(e->binop.lhs, name) || binds(e->binop.rhs, name);
+  default:
+    return false;
+  }
+}
+
+// replace the free occurrences of a name by a literal, or by a variable that
+// no binder of the expression captures
+static void substitute(expr_t *e, str_t name, expr_t *literal) {
+  switch (e->kind) {
+  case E_VAR:
+    if (str_comp(e->var.name, name)) {
+      *e = *literal;
+    }
+    break;
+  case E_CALL:
+  case E_CALL_FUN:
+    substitute(e->call.callee, name, literal);
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      substitute(&e->call.args[i], name, literal);
+    }
+    break;
+  case E_LET:
+    substitute(e->let.expr, name, literal);
+    if (!str_comp(e->let.name, name)) {
+      substitute(e->let.body, name, literal);
+    }
+    break;
+  case E_LETREC:
+    if (!str_comp(e->let.name, name)) {
+      substitute(e->let.expr, name, literal);
+      substitute(e->let.body, name, literal);
+    }
+    break;
+  case E_FUN:
+    for (usize i = 0; i < e->fun.arity; ++i) {
+      if (str_comp(e->fun.params[i], name)) {
+        return;
+      }
+    }
+    substitute(e->fun.body, name, literal);
+    break;
+  case E_IFTHEN:
+    substitute(e->ifthen.cond, name, literal);
+    substitute(e->ifthen.then_body, name, literal);
+    substitute(e->ifthen.else_body, name, literal);
+    break;
+  case E_NEG:
+    substitute(e->unop.rhs, name, literal);
+    break;
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR:
+    substitute(e->binop.lhs, name, literal);
+    substitute(e->binop.rhs, name, literal);
+    break;
+  default:
+    break;
+  }
+}
+
+// a saturated call of a function literal can become a chain of let bindings
+// of its parameters, as long as no argument refers to a name bound by an
+// earlier parameter
+static bool can_beta_reduce(expr_t *e) {
+  expr_t *callee = e->call.callee;
+  if (callee->kind != E_FUN || callee->fun.memo ||
+      callee->fun.arity != e->call.nargs) {
+    return false;
+  }
+  for (usize i = 0; i < e->call.nargs; ++i) {
+    for (usize j = 0; j < i; ++j) {
+      if (occurs_free(&e->call.args[i], callee->fun.params[j])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void beta_reduce(expr_t *e) {
+  efun_t *fun = &e->call.callee->fun;
+  expr_t *body = fun->body;
+  for (usize i = fun->arity; i > 1; --i) {
+    expr_t *let = gcalloc(sizeof(expr_t));
+    *let = (expr_t){.kind = E_LET,
+                    .let = (elet_t){.name = fun->params[i - 1],
+                                    .expr = &e->call.args[i - 1],
+                                    .body = body}};
+    body = let;
+  }
+  *e = (expr_t){
+      .kind = E_LET,
+      .let = (elet_t){
+          .name = fun->params[0], .expr = &e->call.args[0], .body = body}};
+}
+
+// number of nodes of an expression, counted up to a limit
+static usize expr_size(expr_t *e, usize limit) {
+  if (limit == 0) {
+    return 0;
+  }
+  switch (e->kind) {
+  case E_CALL:
+  case E_CALL_FUN: {
+    usize size = 1 + expr_size(e->call.callee, limit - 1);
+    for (usize i = 0; i < e->call.nargs && size < limit; ++i) {
+      size += expr_size(&e->call.args[i], limit - size);
+    }
+    return size;
+  }
+  case E_LET:
+  case E_LETREC: {
+    usize size = 1 + expr_size(e->let.expr, limit - 1);
+    return size < limit ? size + expr_size(e->let.body, limit - size) : size;
+  }
+  case E_FUN:
+    return 1 + expr_size(e->fun.body, limit - 1);
+  case E_IFTHEN: {
+    usize size = 1 + expr_size(e->ifthen.cond, limit - 1);
+    if (size < limit) {
+      size += expr_size(e->ifthen.then_body, limit - size);
+    }
+    if (size < limit) {
+      size += expr_size(e->ifthen.else_body, limit - size);
+    }
+    return size;
+  }
+  case E_NEG:
+    return 1 + expr_size(e->unop.rhs, limit - 1);
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR: {
+    usize size = 1 + expr_size(e->binop.lhs, limit - 1);
+    return size < limit ? size + expr_size(e->binop.rhs, limit - size) : size;
+  }
+  default:
+    return 1;
+  }
+}
+
+// whether a function literal bound by a non-recursive binding can be copied
+// to its call sites
+static bool is_inlinable(expr_t *e) {
+  return e->kind == E_FUN && !e->fun.memo &&
+         expr_size(e->fun.body, INLINE_LIMIT + 1) <= INLINE_LIMIT;
+}
+
+// a name that can't be written in source code, so it never captures a
+// variable of the call site
+static str_t fresh_name(optimizer_t *optimizer, str_t name) {
+  // names that are already fresh keep their original prefix
+  for (usize i = 0; i < name.len; ++i) {
+    if (name.data[i] == '#') {
+      name.len = i;
+      break;
+    }
+  }
+  char buf[64];
+  i32 len = snprintf(buf, sizeof(buf), "%.*s#%lu",
+                     (int)(name.len < 32 ? name.len : 32), name.data,
+                     optimizer->fresh++);
+  return str_from((u8 *)buf, (usize)len);
+}
+
+typedef struct renames {
+  str_t from;
+  str_t to;
+  struct renames *next;
+} renames_t;
+
+static str_t rename_binder(optimizer_t *optimizer, renames_t **renames,
+                           str_t name) {
+  renames_t *inner = gcalloc(sizeof(renames_t));
+  *inner = (renames_t){
+      .from = name, .to = fresh_name(optimizer, name), .next = *renames};
+  *renames = inner;
+  return inner->to;
+}
+
+// copy of a function bound by a name, for a call site
+typedef struct inlining {
+  optimizer_t *optimizer;
+  // local names at the call site
+  names_t *names;
+  // local binding of the function or, if NULL, position of its toplevel
+  // binding
+  names_t *binding;
+  usize global;
+  // a free variable of the function refers to another binding at the call site
+  bool captured;
+} inlining_t;
+
+// whether a free variable of an inlined function refers to the same binding at
+// the call site: it may not be bound again by the binding of the function
+// itself, or between that binding and the call site
+static bool same_binding(inlining_t *in, str_t name) {
+  names_t *end = (in->binding != NULL) ? in->binding->next : NULL;
+  for (names_t *names = in->names; names != end; names = names->next) {
+    if (str_comp(names->name, name)) {
+      return false;
+    }
+  }
+  if (in->binding != NULL) {
+    return true;
+  }
+  global_t *global = hashmap_get(in->optimizer->globals, name);
+  return global == NULL || global->index < in->global;
+}
+
+// copy an expression, giving fresh names to all of its binders. The free
+// variables keep their names. Only the syntax is copied: the resolver and the
+// evaluators fill in the rest for the copy.
+static expr_t *copy_expr(inlining_t *in, renames_t *renames, expr_t *e) {
+  optimizer_t *optimizer = in->optimizer;
+  expr_t *copy = gcalloc(sizeof(expr_t));
+  switch (e->kind) {
+  case E_VAR:
+    *copy = (expr_t){.kind = E_VAR, .var = (evar_t){.name = e->var.name}};
+    for (; renames != NULL; renames = renames->next) {
+      if (str_comp(renames->from, e->var.name)) {
+        copy->var.name = renames->to;
+        break;
+      }
+    }
+    if (renames == NULL && !same_binding(in, e->var.name)) {
+      in->captured = true;
+    }
+    break;
+  case E_CALL:
+  case E_CALL_FUN: {
+    expr_t *args = gcalloc(sizeof(expr_t) * e->call.nargs);
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      args[i] = *copy_expr(in, renames, &e->call.args[i]);
+    }
+    *copy = (expr_t){
+        .kind = E_CALL,
+        .call = (ecall_t){.callee = copy_expr(in, renames, e->call.callee),
+                          .nargs = e->call.nargs,
+                          .args = args}};
+    break;
+  }
+  case E_LET: {
+    expr_t *expr = copy_expr(in, renames, e->let.expr);
+    str_t name = rename_binder(optimizer, &renames, e->let.name);
+    *copy = (expr_t){
+        .kind = E_LET,
+        .let = (elet_t){.name = name,
+                        .expr = expr,
+                        .body = copy_expr(in, renames, e->let.body)}};
+    break;
+  }
+  case E_LETREC: {
+    str_t name = rename_binder(optimizer, &renames, e->let.name);
+    *copy = (expr_t){
+        .kind = E_LETREC,
+        .let = (elet_t){.name = name,
+                        .expr = copy_expr(in, renames, e->let.expr),
+                        .body = copy_expr(in, renames, e->let.body)}};
+    break;
+  }
+  case E_FUN: {
+    str_t *params = gcalloc(sizeof(str_t) * e->fun.arity);
+    for (usize i = 0; i < e->fun.arity; ++i) {
+      params[i] = rename_binder(optimizer, &renames, e->fun.params[i]);
+    }
+    *copy = (expr_t){
+        .kind = E_FUN,
+        .fun = (efun_t){.arity = e->fun.arity,
+                        .params = params,
+                        .body = copy_expr(in, renames, e->fun.body),
+                        .memo = e->fun.memo}};
+    break;
+  }
+  case E_IFTHEN:
+    *copy = (expr_t){
+        .kind = E_IFTHEN,
+        .ifthen = (eif_t){
+            .cond = copy_expr(in, renames, e->ifthen.cond),
+            .then_body = copy_expr(in, renames, e->ifthen.then_body),
+            .else_body = copy_expr(in, renames, e->ifthen.else_body)}};
+    break;
+  case E_NEG:
+    *copy = (expr_t){
+        .kind = E_NEG,
+        .unop = (eunop_t){.rhs = copy_expr(in, renames, e->unop.rhs)}};
+    break;
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR:
+    *copy = (expr_t){
+        .kind = e->kind,
+        .binop = (ebinop_t){.lhs = copy_expr(in, renames, e->binop.lhs),
+                            .rhs = copy_expr(in, renames, e->binop.rhs)}};
+    break;
+  default:
+    *copy = *e;
+    break;
+  }
+  return copy;
+}
+
+// copy the function bound by a name to a call site with the given number of
+// arguments, if it can be inlined there
+static expr_t *inline_fun(optimizer_t *optimizer, names_t *names, str_t name,
+                          usize nargs) {
+  inlining_t in = {.optimizer = optimizer,
+                   .names = names,
+                   .binding = lookup(names, name),
+                   .global = 0,
+                   .captured = false};
+  expr_t *fun;
+  if (in.binding != NULL) {
+    fun = in.binding->fun;
+  } else {
+    global_t *global = hashmap_get(optimizer->globals, name);
+    if (global == NULL) {
+      return NULL;
+    }
+    fun = global->fun;
+    in.global = global->index;
+  }
+  if (fun == NULL || fun->fun.arity != nargs) {
+    return NULL;
+  }
+  expr_t *copy = copy_expr(&in, NULL, fun);
+  return in.captured ? NULL : copy;
+}
+
+static void optimize_expr(optimizer_t *optimizer, names_t *names, expr_t *e) {
+  switch (e->kind) {
+  case E_CALL:
+  case E_CALL_FUN:
+    optimize_expr(optimizer, names, e->call.callee);
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      optimize_expr(optimizer, names, &e->call.args[i]);
+    }
+    if (e->call.callee->kind == E_VAR) {
+      expr_t *fun = inline_fun(optimizer, names, e->call.callee->var.name,
+                               e->call.nargs);
+      if (fun != NULL) {
+        e->call.callee = fun;
+      }
+    }
+    if (can_beta_reduce(e)) {
+      beta_reduce(e);
+      optimize_expr(optimizer, names, e);
+    }
+    break;
+  case E_LET: {
+    optimize_expr(optimizer, names, e->let.expr);
+    if (is_literal(e->let.expr) ||
+        (e->let.expr->kind == E_VAR &&
+         !binds(e->let.body, e->let.expr->var.name))) {
+      substitute(e->let.body, e->let.name, e->let.expr);
+    }
+    expr_t *fun = is_inlinable(e->let.expr) ? e->let.expr : NULL;
+    optimize_expr(optimizer, bind(names, e->let.name, true, fun), e->let.body);
+    if (is_pure(optimizer, names, e->let.expr) &&
+        !occurs_free(e->let.body, e->let.name)) {
+      *e = *e->let.body;
+    }
+    break;
+  }
+  case E_LETREC: {
+    names_t *inner = bind(names, e->let.name, true, NULL);
+    optimize_expr(optimizer, inner, e->let.expr);
+    optimize_expr(optimizer, inner, e->let.body);
+    if (e->let.expr->kind == E_FUN &&
+        !occurs_free(e->let.body, e->let.name)) {
+      *e = *e->let.body;
+    }
+    break;
+  }
+  case E_FUN: {
+    names_t *inner = names;
+    for (usize i = 0; i < e->fun.arity; ++i) {
+      inner = bind(inner, e->fun.params[i], true, NULL);
+    }
+    optimize_expr(optimizer, inner, e->fun.body);
+    break;
+  }
+  case E_IFTHEN:
+    optimize_expr(optimizer, names, e->ifthen.cond);
+    if (e->ifthen.cond->kind == E_BOOL) {
+      *e = e->ifthen.cond->boolean ? *e->ifthen.then_body
+                                   : *e->ifthen.else_body;
+      optimize_expr(optimizer, names, e);
+    } else {
+      optimize_expr(optimizer, names, e->ifthen.then_body);
+      optimize_expr(optimizer, names, e->ifthen.else_body);
+    }
+    break;
+  case E_NEG:
+    optimize_expr(optimizer, names, e->unop.rhs);
+    if (is_literal(e->unop.rhs)) {
+      fold(e, value_neg(literal_value(e->unop.rhs)));
+    }
+    break;
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR: {
+    optimize_expr(optimizer, names, e->binop.lhs);
+    optimize_expr(optimizer, names, e->binop.rhs);
+    if (!is_literal(e->binop.lhs) || !is_literal(e->binop.rhs)) {
+      break;
+    }
+    value_t lhs = literal_value(e->binop.lhs);
+    value_t rhs = literal_value(e->binop.rhs);
+    switch (e->kind) {
+    case E_ADD:
+    case E_ADD_NUM:
+    case E_ADD_INT:
+    case E_ADD_STR:
+      fold(e, value_add(lhs, rhs));
+      break;
+    case E_SUB:
+    case E_SUB_NUM:
+    case E_SUB_INT:
+      fold(e, value_sub(lhs, rhs));
+      break;
+    case E_MUL:
+    case E_MUL_NUM:
+    case E_MUL_INT:
+      fold(e, value_mul(lhs, rhs));
+      break;
+    case E_DIV:
+      fold(e, value_div(lhs, rhs));
+      break;
+    default:
+      fold(e, value_eq(lhs, rhs));
+      break;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void optimize_toplevel(optimizer_t *optimizer, toplevel_t *tl) {
+  switch (tl->kind) {
+  case TL_EXPR:
+    optimize_expr(optimizer, NULL, &tl->expr);
+    break;
+  case TL_LET: {
+    optimize_expr(optimizer, NULL, &tl->let.expr);
+    expr_t *fun = is_inlinable(&tl->let.expr) ? &tl->let.expr : NULL;
+    bool pure = is_literal(&tl->let.expr) || tl->let.expr.kind == E_FUN;
+    bind_global(optimizer, tl->let.name, pure, fun);
+    break;
+  }
+  case TL_LETREC:
+    bind_global(optimizer, tl->let.name, tl->let.expr.kind == E_FUN, NULL);
+    optimize_expr(optimizer, NULL, &tl->let.expr);
+    break;
+  case TL_ERROR:
+    break;
+  }
+}
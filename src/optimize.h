@@ -0,0 +1,21 @@
+#pragma once
+
+#include "ast.h"
+#include "hashmap.h"
+#include "utils.h"
+
+// bindings of the previous toplevels, carried between toplevels
+typedef struct optimizer {
+  // what is known about the latest binding of each name
+  hashmap_t globals;
+  usize nglobals;
+  // counter for the fresh names of inlined bindings
+  usize fresh;
+} optimizer_t;
+
+optimizer_t optimizer_new();
+// rewrite a parsed toplevel into an equivalent, cheaper one: constant folding,
+// propagation of literal bindings, removal of unused pure bindings, inlining of
+// small non-recursive functions, and beta reduction of immediately applied
+// functions. It runs before the resolver, on variables that are still names.
+void optimize_toplevel(optimizer_t *optimizer, toplevel_t *tl);
@@ -0,0 +1,464 @@
+// threads that are not created by the collector register themselves
+#define GC_THREADS
+#include <gc/gc.h>
+#include <string.h>
+#include <threads.h>
+
+#include "ast.h"
+#include "eval.h"
+#include "lex.h"
+#include "parallel.h"
+#include "utils.h"
+
+// job defining no global slot of the batch
+#define NO_JOB SIZE_MAX
+// smallest chunk of the input worth lexing and parsing on its own, and number
+// of chunks per thread, so that threads finishing early take more
+#define MIN_CHUNK (16ul * 1024)
+#define CHUNKS_PER_THREAD 4
+
+typedef struct job {
+  toplevel_t *tl;
+  // jobs waiting for this one, and number of jobs this one waits for
+  usize *dependents;
+  usize ndependents;
+  usize dependents_cap;
+  usize waiting;
+  bool done;
+  value_t result;
+} job_t;
+
+typedef struct pool {
+  job_t *jobs;
+  usize len;
+  // queue of the jobs ready to run, in the order they became ready
+  usize *ready;
+  usize ready_head;
+  usize ready_tail;
+  usize finished;
+  mtx_t lock;
+  // signaled when a job is ready or all are done, and when a job is done
+  cnd_t work;
+  cnd_t progress;
+} pool_t;
+
+typedef struct deps {
+  pool_t *pool;
+  // job defining each global slot, or NO_JOB for slots of earlier batches
+  usize *owners;
+  usize nslots;
+  // job whose dependencies are collected, and last job each job was added as
+  // a dependency of, plus one
+  usize job;
+  usize *marks;
+} deps_t;
+
+typedef struct chunk {
+  const u8 *data;
+  usize len;
+  // token lexing stopped at, and the stream where it stopped
+  token_t stop;
+  lexstream_t stream;
+  // toplevels parsed from the chunk, up to the first that failed to parse
+  toplevel_t **tls;
+  usize ntls;
+} chunk_t;
+
+typedef struct frontend {
+  chunk_t *chunks;
+  usize len;
+  // next chunk to be taken by a thread
+  usize next;
+  mtx_t lock;
+} frontend_t;
+
+static void allow_threads() {
+  static bool threads_allowed = false;
+  if (!threads_allowed) {
+    GC_allow_register_threads();
+    threads_allowed = true;
+  }
+}
+
+static void add_dependency(deps_t *deps, usize slot) {
+  if (slot >= deps->nslots) {
+    return;
+  }
+  usize owner = deps->owners[slot];
+  // a recursive binding refers to its own slot
+  if (owner == NO_JOB || owner == deps->job ||
+      deps->marks[owner] == deps->job + 1) {
+    return;
+  }
+  deps->marks[owner] = deps->job + 1;
+  job_t *job = &deps->pool->jobs[owner];
+  if (job->ndependents == job->dependents_cap) {
+    job->dependents_cap =
+        (job->dependents_cap == 0) ? 4 : 2 * job->dependents_cap;
+    job->dependents =
+        gcrealloc_atomic(job->dependents, job->dependents_cap * sizeof(usize));
+  }
+  job->dependents[job->ndependents++] = deps->job;
+  deps->pool->jobs[deps->job].waiting += 1;
+}
+
+// the globals read by an expression, including in the bodies of its functions
+static void collect_dependencies(deps_t *deps, expr_t *e) {
+  switch (e->kind) {
+  case E_VAR:
+    if (e->var.scope == VAR_GLOBAL) {
+      add_dependency(deps, e->var.slot);
+    }
+    break;
+  case E_CALL:
+  case E_CALL_FUN:
+    collect_dependencies(deps, e->call.callee);
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      collect_dependencies(deps, &e->call.args[i]);
+    }
+    break;
+  case E_LET:
+  case E_LETREC:
+    collect_dependencies(deps, e->let.expr);
+    collect_dependencies(deps, e->let.body);
+    break;
+  case E_FUN:
+    collect_dependencies(deps, e->fun.body);
+    break;
+  case E_IFTHEN:
+    collect_dependencies(deps, e->ifthen.cond);
+    collect_dependencies(deps, e->ifthen.then_body);
+    collect_dependencies(deps, e->ifthen.else_body);
+    break;
+  case E_NEG:
+    collect_dependencies(deps, e->unop.rhs);
+    break;
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR:
+    collect_dependencies(deps, e->binop.lhs);
+    collect_dependencies(deps, e->binop.rhs);
+    break;
+  default:
+    break;
+  }
+}
+
+static bool is_binding(toplevel_t *tl) {
+  return tl->kind == TL_LET || tl->kind == TL_LETREC;
+}
+
+// build the dependency graph of the jobs, and queue the jobs waiting for none
+static void schedule(pool_t *pool) {
+  deps_t deps = {.pool = pool, .nslots = 0};
+  for (usize i = 0; i < pool->len; ++i) {
+    toplevel_t *tl = pool->jobs[i].tl;
+    if (is_binding(tl) && tl->let.global >= deps.nslots) {
+      deps.nslots = tl->let.global + 1;
+    }
+  }
+  deps.owners = gcalloc_atomic(deps.nslots * sizeof(usize));
+  for (usize i = 0; i < deps.nslots; ++i) {
+    deps.owners[i] = NO_JOB;
+  }
+  deps.marks = gcalloc_atomic(pool->len * sizeof(usize));
+  for (usize i = 0; i < pool->len; ++i) {
+    deps.marks[i] = 0;
+  }
+  globals_reserve(deps.nslots);
+
+  for (usize i = 0; i < pool->len; ++i) {
+    toplevel_t *tl = pool->jobs[i].tl;
+    deps.job = i;
+    // a recursive binding is defined by its own job
+    if (tl->kind == TL_LETREC) {
+      deps.owners[tl->let.global] = i;
+    }
+    if (tl->kind == TL_EXPR) {
+      collect_dependencies(&deps, &tl->expr);
+    } else if (is_binding(tl)) {
+      collect_dependencies(&deps, &tl->let.expr);
+      deps.owners[tl->let.global] = i;
+    }
+    if (pool->jobs[i].waiting == 0) {
+      pool->ready[pool->ready_tail++] = i;
+    }
+  }
+}
+
+static i32 worker(void *arg) {
+  pool_t *pool = arg;
+  struct GC_stack_base base;
+  GC_get_stack_base(&base);
+  GC_register_my_thread(&base);
+
+  mtx_lock(&pool->lock);
+  loop {
+    while (pool->ready_head == pool->ready_tail &&
+           pool->finished < pool->len) {
+      cnd_wait(&pool->work, &pool->lock);
+    }
+    if (pool->ready_head == pool->ready_tail) {
+      break;
+    }
+    job_t *job = &pool->jobs[pool->ready[pool->ready_head++]];
+    mtx_unlock(&pool->lock);
+    value_t result = eval_toplevel(job->tl);
+    mtx_lock(&pool->lock);
+
+    job->result = result;
+    job->done = true;
+    pool->finished += 1;
+    for (usize i = 0; i < job->ndependents; ++i) {
+      job_t *dependent = &pool->jobs[job->dependents[i]];
+      dependent->waiting -= 1;
+      if (dependent->waiting == 0) {
+        pool->ready[pool->ready_tail++] = job->dependents[i];
+        cnd_signal(&pool->work);
+      }
+    }
+    if (pool->finished == pool->len) {
+      cnd_broadcast(&pool->work);
+    }
+    cnd_broadcast(&pool->progress);
+  }
+  mtx_unlock(&pool->lock);
+
+  GC_unregister_my_thread();
+  return 0;
+}
+
+void walk_parallel(toplevel_t **tls, usize len, usize threads) {
+  if (len == 0) {
+    return;
+  }
+  allow_threads();
+  use_heap_frames();
+
+  pool_t pool = {.len = len, .ready_head = 0, .ready_tail = 0, .finished = 0};
+  pool.jobs = gcalloc(len * sizeof(job_t));
+  for (usize i = 0; i < len; ++i) {
+    pool.jobs[i] = (job_t){.tl = tls[i],
+                           .dependents = NULL,
+                           .ndependents = 0,
+                           .dependents_cap = 0,
+                           .waiting = 0,
+                           .done = false,
+                           .result = UNIT};
+  }
+  pool.ready = gcalloc_atomic(len * sizeof(usize));
+  schedule(&pool);
+  if (mtx_init(&pool.lock, mtx_plain) != thrd_success ||
+      cnd_init(&pool.work) != thrd_success ||
+      cnd_init(&pool.progress) != thrd_success) {
+    panic("failed to create the thread pool");
+  }
+
+  if (threads > len) {
+    threads = len;
+  }
+  thrd_t *workers = gcalloc_atomic(threads * sizeof(thrd_t));
+  for (usize i = 0; i < threads; ++i) {
+    if (thrd_create(&workers[i], worker, &pool) != thrd_success) {
+      panic("failed to create a worker thread");
+    }
+  }
+
+  for (usize i = 0; i < len; ++i) {
+    mtx_lock(&pool.lock);
+    while (!pool.jobs[i].done) {
+      cnd_wait(&pool.progress, &pool.lock);
+    }
+    mtx_unlock(&pool.lock);
+    print_result(&pool.jobs[i].result);
+  }
+
+  for (usize i = 0; i < threads; ++i) {
+    thrd_join(workers[i], NULL);
+  }
+  cnd_destroy(&pool.progress);
+  cnd_destroy(&pool.work);
+  mtx_destroy(&pool.lock);
+}
+
+static void push_chunk(frontend_t *fe, usize *cap, const u8 *data, usize len) {
+  if (fe->len == *cap) {
+    *cap = (*cap == 0) ? 16 : 2 * *cap;
+    fe->chunks = gcrealloc(fe->chunks, *cap * sizeof(chunk_t));
+  }
+  fe->chunks[fe->len++] = (chunk_t){
+      .data = data, .len = len, .stop = {.kind = T_INCOMPLETE}, .ntls = 0};
+}
+
+// split the input after the `;;` outside of string literals and comments,
+// which no token or toplevel spans, into chunks of at least target bytes
+static void split(frontend_t *fe, const u8 *data, usize len, usize target) {
+  usize cap = 0;
+  usize start = 0;
+  usize i = 0;
+  while (i < len) {
+    switch (data[i]) {
+    case '"':
+      // the character after a backslash is escaped
+      for (i += 1; i < len && data[i] != '"'; ++i) {
+        if (data[i] == '\\') {
+          i += 1;
+        }
+      }
+      i += 1;
+      break;
+    case '/':
+      if (i + 1 < len && data[i + 1] == '/') {
+        while (i < len && data[i] != '\n') {
+          i += 1;
+        }
+      } else {
+        i += 1;
+      }
+      break;
+    case ';':
+      if (i + 1 < len && data[i + 1] == ';') {
+        i += 2;
+        if (i - start >= target) {
+          push_chunk(fe, &cap, data + start, i - start);
+          start = i;
+        }
+      } else {
+        i += 1;
+      }
+      break;
+    default:
+      i += 1;
+    }
+  }
+  if (start < len || fe->len == 0) {
+    push_chunk(fe, &cap, data + start, len - start);
+  }
+}
+
+static void parse_chunk(chunk_t *chunk, bool alone) {
+  tokenbuf_t tokens = tokenbuf_new();
+  // the input is never modified, and kept alive by the tokens pointing into it
+  chunk->stream = lexstream_new(chunk->data, chunk->len, true);
+  chunk->stop = lex_tokens(&chunk->stream, &tokens);
+  if (chunk->stop.kind == T_INCOMPLETE && chunk->stream.seen != 0) {
+    // only the last chunk ends in a token, when the input does: lex it again
+    // from a copy ending with a newline
+    bytes_t end = bytes_new();
+    bytes_reserve(&end, chunk->stream.len + 1);
+    memcpy(end.data, chunk->stream.data, chunk->stream.len);
+    end.len = chunk->stream.len;
+    bytes_push(&end, '\n');
+    chunk->stream = lexstream_new(end.data, end.len, true);
+    chunk->stop = lex_tokens(&chunk->stream, &tokens);
+  }
+  if (chunk->stop.kind == T_ERROR || chunk->stream.seen != 0) {
+    return;
+  }
+  // trailing whitespace and comments hold no toplevel, but an empty input
+  // still parses as one, like in a single pass
+  if (tokens.len == 0 && !alone) {
+    return;
+  }
+
+  parser_t parser = parser_new(tokens);
+  usize cap = 0;
+  toplevel_t *tl;
+  do {
+    tl = gcalloc(sizeof(toplevel_t));
+    *tl = toplevel(&parser);
+    if (chunk->ntls == cap) {
+      cap = (cap == 0) ? 16 : 2 * cap;
+      chunk->tls = gcrealloc(chunk->tls, cap * sizeof(toplevel_t *));
+    }
+    chunk->tls[chunk->ntls++] = tl;
+  } while (!parser_done(&parser) && tl->kind != TL_ERROR);
+}
+
+static void parse_chunks(frontend_t *fe) {
+  loop {
+    mtx_lock(&fe->lock);
+    usize i = fe->next;
+    fe->next += (i < fe->len);
+    mtx_unlock(&fe->lock);
+    if (i == fe->len) {
+      return;
+    }
+    parse_chunk(&fe->chunks[i], fe->len == 1);
+  }
+}
+
+static i32 parse_worker(void *arg) {
+  struct GC_stack_base base;
+  GC_get_stack_base(&base);
+  GC_register_my_thread(&base);
+  parse_chunks(arg);
+  GC_unregister_my_thread();
+  return 0;
+}
+
+toplevel_t **parse_parallel(const u8 *data, usize len, usize threads,
+                            usize *ntls) {
+  frontend_t fe = {.chunks = NULL, .len = 0, .next = 0};
+  usize target = len / (threads * CHUNKS_PER_THREAD);
+  split(&fe, data, len, (target < MIN_CHUNK) ? MIN_CHUNK : target);
+  if (mtx_init(&fe.lock, mtx_plain) != thrd_success) {
+    panic("failed to create the thread pool");
+  }
+
+  // the calling thread parses chunks too
+  if (threads > fe.len) {
+    threads = fe.len;
+  }
+  thrd_t *workers = NULL;
+  if (threads > 1) {
+    allow_threads();
+    workers = gcalloc_atomic((threads - 1) * sizeof(thrd_t));
+  }
+  for (usize i = 0; i + 1 < threads; ++i) {
+    if (thrd_create(&workers[i], parse_worker, &fe) != thrd_success) {
+      panic("failed to create a worker thread");
+    }
+  }
+  parse_chunks(&fe);
+  for (usize i = 0; i + 1 < threads; ++i) {
+    thrd_join(workers[i], NULL);
+  }
+  mtx_destroy(&fe.lock);
+
+  // the whole input is lexed before anything is parsed, so the first invalid
+  // token is reported even after a toplevel that fails to parse
+  for (usize i = 0; i < fe.len; ++i) {
+    if (fe.chunks[i].stop.kind == T_ERROR || fe.chunks[i].stream.seen != 0) {
+      lex_fail(&fe.chunks[i].stream, fe.chunks[i].stop);
+    }
+  }
+  usize total = 0;
+  for (usize i = 0; i < fe.len; ++i) {
+    total += fe.chunks[i].ntls;
+  }
+  toplevel_t **tls = gcalloc(total * sizeof(toplevel_t *));
+  *ntls = 0;
+  for (usize i = 0; i < fe.len; ++i) {
+    for (usize j = 0; j < fe.chunks[i].ntls; ++j) {
+      toplevel_t *tl = fe.chunks[i].tls[j];
+      tls[(*ntls)++] = tl;
+      if (tl->kind == TL_ERROR) {
+        return tls;
+      }
+    }
+  }
+  return tls;
+}
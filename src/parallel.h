@@ -0,0 +1,17 @@
+#pragma once
+
+#include "ast.h"
+#include "utils.h"
+
+// Evaluate resolved toplevels like walk_file, on a pool of threads. A toplevel
+// waits for the toplevels defining the globals it refers to, anywhere in its
+// expression, and independent toplevels are evaluated concurrently. Results
+// are printed in source order, as soon as all the previous ones are.
+void walk_parallel(toplevel_t **tls, usize len, usize threads);
+
+// Lex and parse a whole input on a pool of threads.
+// The input is split into chunks at `;;` separators, which are parsed
+// concurrently, and their toplevels are returned in source order, up to the
+// first that failed to parse, like parsing the input in a single pass would.
+toplevel_t **parse_parallel(const u8 *data, usize len, usize threads,
+                            usize *ntls);
@@ -0,0 +1,292 @@
+#include "resolve.h"
+#include "ast.h"
+#include "utils.h"
+
+typedef struct binding {
+  str_t name;
+  usize slot;
+  struct binding *next;
+} binding_t;
+
+// a scope corresponds to a single frame at runtime: the frame of a function,
+// or the frame of a toplevel for the scope without parent
+typedef struct scope {
+  binding_t *bindings;
+  usize size;
+  // function scopes capture the free variables of their body that are not
+  // globals
+  evar_t *captures;
+  usize ncaptures;
+  usize captures_cap;
+  struct scope *parent;
+} scope_t;
+
+static scope_t *scope_new(scope_t *parent) {
+  scope_t *scope = gcalloc(sizeof(scope_t));
+  scope->bindings = NULL;
+  scope->size = 0;
+  scope->captures = NULL;
+  scope->ncaptures = 0;
+  scope->captures_cap = 0;
+  scope->parent = parent;
+  return scope;
+}
+
+// reserve a new slot in the scope, without binding it to a name yet
+static usize scope_reserve(scope_t *scope) {
+  usize slot = scope->size;
+  scope->size += 1;
+  return slot;
+}
+
+static void scope_bind(scope_t *scope, str_t name, usize slot) {
+  binding_t *binding = gcalloc(sizeof(binding_t));
+  binding->name = name;
+  binding->slot = slot;
+  binding->next = scope->bindings;
+  scope->bindings = binding;
+}
+
+// remove the most recent binding of the scope, restoring any shadowed one
+static void scope_unbind(scope_t *scope) {
+  scope->bindings = scope->bindings->next;
+}
+
+static usize scope_capture(scope_t *scope, evar_t var) {
+  if (scope->ncaptures >= scope->captures_cap) {
+    usize new_cap = (scope->captures_cap == 0) ? 4 : (scope->captures_cap * 2);
+    scope->captures = gcrealloc(scope->captures, new_cap * sizeof(evar_t));
+    scope->captures_cap = new_cap;
+  }
+  scope->captures[scope->ncaptures] = var;
+  scope->ncaptures += 1;
+  return scope->ncaptures - 1;
+}
+
+// find the address of a name, relative to the frame of the given scope.
+// Function scopes add the free variables they encounter to their captures.
+static evar_t lookup(resolver_t *resolver, scope_t *scope, str_t name) {
+  for (binding_t *b = scope->bindings; b != NULL; b = b->next) {
+    if (str_comp(b->name, name)) {
+      return (evar_t){.name = name, .scope = VAR_LOCAL, .slot = b->slot};
+    }
+  }
+  if (scope->parent == NULL) {
+    usize *global = hashmap_get(resolver->globals, name);
+    if (global != NULL) {
+      return (evar_t){.name = name, .scope = VAR_GLOBAL, .slot = *global};
+    }
+    // unknown bindings are reported when (and if) they are evaluated
+    return (evar_t){.name = name, .scope = VAR_UNBOUND};
+  }
+
+  for (usize i = 0; i < scope->ncaptures; ++i) {
+    if (str_comp(scope->captures[i].name, name)) {
+      return (evar_t){.name = name, .scope = VAR_CAPTURED, .slot = i};
+    }
+  }
+  evar_t outer = lookup(resolver, scope->parent, name);
+  if (outer.scope == VAR_UNBOUND || outer.scope == VAR_GLOBAL) {
+    return outer;
+  }
+  usize slot = scope_capture(scope, outer);
+  return (evar_t){.name = name, .scope = VAR_CAPTURED, .slot = slot};
+}
+
+// whether an expression reads the given slot of its frame, directly or through
+// the captures of the closures it makes
+static bool refers_to(expr_t *e, usize slot) {
+  switch (e->kind) {
+  case E_VAR:
+    return e->var.scope == VAR_LOCAL && e->var.slot == slot;
+  case E_CALL:
+  case E_CALL_FUN:
+    if (refers_to(e->call.callee, slot)) {
+      return true;
+    }
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      if (refers_to(&e->call.args[i], slot)) {
+        return true;
+      }
+    }
+    return false;
+  case E_LET:
+  case E_LETREC:
+    return refers_to(e->let.expr, slot) || refers_to(e->let.body, slot);
+  case E_FUN:
+    for (usize i = 0; i < e->fun.ncaptures; ++i) {
+      evar_t *var = &e->fun.captures[i];
+      if (var->scope == VAR_LOCAL && var->slot == slot) {
+        return true;
+      }
+    }
+    return false;
+  case E_IFTHEN:
+    return refers_to(e->ifthen.cond, slot) ||
+           refers_to(e->ifthen.then_body, slot) ||
+           refers_to(e->ifthen.else_body, slot);
+  case E_NEG:
+    return refers_to(e->unop.rhs, slot);
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR:
+    return refers_to(e->binop.lhs, slot) || refers_to(e->binop.rhs, slot);
+  default:
+    return false;
+  }
+}
+
+// A recursive closure captures its own slot before it is filled, and the copy
+// is patched once the closure exists (see tie_knot). Only the closure the
+// binding evaluates to is patched, so the slot may only be read by it.
+static bool ties_knot(expr_t *e, usize slot) {
+  switch (e->kind) {
+  case E_FUN:
+    return true;
+  case E_LET:
+  case E_LETREC:
+    return !refers_to(e->let.expr, slot) && ties_knot(e->let.body, slot);
+  case E_IFTHEN:
+    return !refers_to(e->ifthen.cond, slot) &&
+           ties_knot(e->ifthen.then_body, slot) &&
+           ties_knot(e->ifthen.else_body, slot);
+  default:
+    return false;
+  }
+}
+
+static void resolve_expr(resolver_t *resolver, scope_t *scope, expr_t *e) {
+  switch (e->kind) {
+  case E_NUM:
+  case E_INT:
+  case E_STR:
+  case E_BOOL:
+  case E_UNIT:
+  case E_ERROR:
+  case E_NOMATCH:
+    break;
+  case E_VAR:
+    e->var = lookup(resolver, scope, e->var.name);
+    break;
+  case E_CALL:
+  case E_CALL_FUN:
+    resolve_expr(resolver, scope, e->call.callee);
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      resolve_expr(resolver, scope, &e->call.args[i]);
+    }
+    break;
+  case E_LET:
+    resolve_expr(resolver, scope, e->let.expr);
+    e->let.slot = scope_reserve(scope);
+    scope_bind(scope, e->let.name, e->let.slot);
+    resolve_expr(resolver, scope, e->let.body);
+    scope_unbind(scope);
+    break;
+  case E_LETREC:
+    e->let.slot = scope_reserve(scope);
+    scope_bind(scope, e->let.name, e->let.slot);
+    resolve_expr(resolver, scope, e->let.expr);
+    if (refers_to(e->let.expr, e->let.slot) &&
+        !ties_knot(e->let.expr, e->let.slot)) {
+      resolver->error = STR("let rec must bind a function");
+    }
+    resolve_expr(resolver, scope, e->let.body);
+    scope_unbind(scope);
+    break;
+  case E_FUN: {
+    scope_t *inner = scope_new(scope);
+    for (usize i = 0; i < e->fun.arity; ++i) {
+      scope_bind(inner, e->fun.params[i], scope_reserve(inner));
+    }
+    resolve_expr(resolver, inner, e->fun.body);
+    e->fun.frame_size = inner->size;
+    e->fun.ncaptures = inner->ncaptures;
+    e->fun.captures = inner->captures;
+    break;
+  }
+  case E_IFTHEN:
+    resolve_expr(resolver, scope, e->ifthen.cond);
+    resolve_expr(resolver, scope, e->ifthen.then_body);
+    resolve_expr(resolver, scope, e->ifthen.else_body);
+    break;
+  case E_NEG:
+    resolve_expr(resolver, scope, e->unop.rhs);
+    break;
+  case E_ADD:
+  case E_SUB:
+  case E_MUL:
+  case E_DIV:
+  case E_EQ:
+  case E_ADD_NUM:
+  case E_SUB_NUM:
+  case E_MUL_NUM:
+  case E_EQ_NUM:
+  case E_ADD_INT:
+  case E_SUB_INT:
+  case E_MUL_INT:
+  case E_EQ_INT:
+  case E_ADD_STR:
+  case E_EQ_STR:
+    resolve_expr(resolver, scope, e->binop.lhs);
+    resolve_expr(resolver, scope, e->binop.rhs);
+    break;
+  }
+}
+
+resolver_t resolver_new() {
+  return (resolver_t){.globals = hashmap_new(sizeof(usize)),
+                      .nglobals = 0,
+                      .error = {.len = 0, .data = NULL}};
+}
+
+// give a toplevel binding a new global slot. Code resolved earlier keeps the
+// slot of the binding it saw, so redefinitions only shadow the previous ones.
+static void bind_global(resolver_t *resolver, toplevel_t *tl) {
+  tl->let.global = resolver->nglobals;
+  resolver->nglobals += 1;
+  hashmap_insert(resolver->globals, tl->let.name, &tl->let.global);
+}
+
+void resolve_toplevel(resolver_t *resolver, toplevel_t *tl) {
+  // the frame of a toplevel only holds the let bindings of its expression, and
+  // is discarded after evaluation
+  scope_t *scope = scope_new(NULL);
+  switch (tl->kind) {
+  case TL_EXPR:
+    resolve_expr(resolver, scope, &tl->expr);
+    tl->frame_size = scope->size;
+    break;
+  case TL_LET:
+    resolve_expr(resolver, scope, &tl->let.expr);
+    bind_global(resolver, tl);
+    tl->frame_size = scope->size;
+    break;
+  case TL_LETREC:
+    bind_global(resolver, tl);
+    resolve_expr(resolver, scope, &tl->let.expr);
+    tl->frame_size = scope->size;
+    break;
+  case TL_ERROR:
+    break;
+  }
+  if (resolver->error.len > 0) {
+    // the message goes after the toplevel one, like parse errors
+    error_chain_t *next = gcalloc(sizeof(error_chain_t));
+    *next = (error_chain_t){.msg = resolver->error, .next = NULL};
+    tl->kind = TL_ERROR;
+    tl->error = (error_chain_t){.msg = STR("invalid toplevel"), .next = next};
+    resolver->error = (str_t){.len = 0, .data = NULL};
+  }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "ast.h"
+#include "utils.h"
+
+#include "hashmap.h"
+
+// toplevel bindings carried between toplevels
+typedef struct resolver {
+  // global slot of the latest binding of each name
+  hashmap_t globals;
+  usize nglobals;
+  // error found in the toplevel being resolved, empty if there is none
+  str_t error;
+} resolver_t;
+
+resolver_t resolver_new();
+// rewrite the variables of a toplevel into addresses in frames, closures or
+// globals, and compute the frame sizes of its functions and of the toplevel
+// itself. A toplevel that can't be evaluated becomes an error.
+void resolve_toplevel(resolver_t *resolver, toplevel_t *tl);
@@ -0,0 +1,552 @@
+#include <string.h>
+
+#include "ast.h"
+#include "typecheck.h"
+#include "utils.h"
+
+#define INFER(__bind, __args...)                                               \
+  type_t *__bind = infer(__args);                                              \
+  if (__bind == NULL) {                                                        \
+    return NULL;                                                               \
+  }
+
+typedef enum typekind {
+  TY_VAR,
+  TY_NUM,
+  TY_STR,
+  TY_BOOL,
+  TY_UNIT,
+  TY_FUN,
+} typekind_t;
+
+// sets of kinds of types, for the types a variable can stand for
+#define KIND(__kind) (1u << (__kind))
+#define ANY_KIND                                                               \
+  (KIND(TY_NUM) | KIND(TY_STR) | KIND(TY_BOOL) | KIND(TY_UNIT) | KIND(TY_FUN))
+// operand types of the operators, as accepted by the primitives of eval.c
+#define ADD_KINDS (KIND(TY_NUM) | KIND(TY_STR) | KIND(TY_BOOL))
+#define ARITH_KINDS (KIND(TY_NUM) | KIND(TY_BOOL))
+#define DIV_KINDS KIND(TY_NUM)
+#define EQ_KINDS (KIND(TY_NUM) | KIND(TY_STR) | KIND(TY_BOOL) | KIND(TY_UNIT))
+
+// level of the variables of a type scheme, replaced by fresh variables at
+// each use of the binding
+#define GENERIC UINT32_MAX
+
+typedef struct type {
+  typekind_t kind;
+  // type variables: the type they were unified with, the let nesting level
+  // they were created at, and the kinds of types they can stand for
+  struct type *link;
+  u32 level;
+  u8 kinds;
+  // function types, curried
+  struct type *param;
+  struct type *result;
+} type_t;
+
+static type_t NUM_TYPE = {.kind = TY_NUM};
+static type_t STR_TYPE = {.kind = TY_STR};
+static type_t BOOL_TYPE = {.kind = TY_BOOL};
+static type_t UNIT_TYPE = {.kind = TY_UNIT};
+
+static type_t *fresh_var(typechecker_t *tc, u8 kinds) {
+  type_t *var = gcalloc(sizeof(type_t));
+  *var = (type_t){.kind = TY_VAR, .level = tc->level, .kinds = kinds};
+  return var;
+}
+
+static type_t *fun_type(type_t *param, type_t *result) {
+  type_t *fun = gcalloc(sizeof(type_t));
+  *fun = (type_t){.kind = TY_FUN, .param = param, .result = result};
+  return fun;
+}
+
+// the type a variable was unified with, compressing chains of variables
+static type_t *find(type_t *t) {
+  while (t->kind == TY_VAR && t->link != NULL) {
+    if (t->link->kind == TY_VAR && t->link->link != NULL) {
+      t->link = t->link->link;
+    }
+    t = t->link;
+  }
+  return t;
+}
+
+// whether a variable occurs in a type. Variables of the type are moved to the
+// level of the variable, as they can no longer be generalized before it.
+static bool occurs(type_t *var, type_t *t) {
+  t = find(t);
+  if (t == var) {
+    return true;
+  }
+  if (t->kind == TY_VAR) {
+    if (t->level > var->level) {
+      t->level = var->level;
+    }
+    return false;
+  }
+  if (t->kind == TY_FUN) {
+    return occurs(var, t->param) || occurs(var, t->result);
+  }
+  return false;
+}
+
+static bool unify(type_t *a, type_t *b) {
+  a = find(a);
+  b = find(b);
+  if (a == b) {
+    return true;
+  }
+  if (a->kind == TY_VAR && b->kind == TY_VAR) {
+    u8 kinds = a->kinds & b->kinds;
+    if (kinds == 0) {
+      return false;
+    }
+    b->kinds = kinds;
+    if (a->level < b->level) {
+      b->level = a->level;
+    }
+    a->link = b;
+    return true;
+  }
+  if (b->kind == TY_VAR) {
+    type_t *tmp = a;
+    a = b;
+    b = tmp;
+  }
+  if (a->kind == TY_VAR) {
+    if ((a->kinds & KIND(b->kind)) == 0 || occurs(a, b)) {
+      return false;
+    }
+    a->link = b;
+    return true;
+  }
+  if (a->kind != b->kind) {
+    return false;
+  }
+  if (a->kind == TY_FUN) {
+    return unify(a->param, b->param) && unify(a->result, b->result);
+  }
+  return true;
+}
+
+// names of the type variables of an error message, in order of appearance
+typedef struct names {
+  type_t *vars[26];
+  usize len;
+} names_t;
+
+static void push_cstr(bytes_t *b, const char *s) {
+  for (; *s != 0; ++s) {
+    bytes_push(b, (u8)*s);
+  }
+}
+
+static void push_type(bytes_t *b, names_t *names, type_t *t) {
+  t = find(t);
+  switch (t->kind) {
+  case TY_VAR: {
+    usize i = 0;
+    while (i < names->len && names->vars[i] != t) {
+      ++i;
+    }
+    if (i == names->len && names->len < 26) {
+      names->vars[names->len++] = t;
+    }
+    bytes_push(b, '\'');
+    bytes_push(b, (i < 26) ? (u8)('a' + i) : '_');
+    break;
+  }
+  case TY_NUM:
+    push_cstr(b, "num");
+    break;
+  case TY_STR:
+    push_cstr(b, "str");
+    break;
+  case TY_BOOL:
+    push_cstr(b, "bool");
+    break;
+  case TY_UNIT:
+    push_cstr(b, "unit");
+    break;
+  case TY_FUN: {
+    bool nested = find(t->param)->kind == TY_FUN;
+    if (nested) {
+      bytes_push(b, '(');
+    }
+    push_type(b, names, t->param);
+    push_cstr(b, nested ? ") -> " : " -> ");
+    push_type(b, names, t->result);
+    break;
+  }
+  }
+}
+
+static void set_error(typechecker_t *tc, bytes_t msg) {
+  tc->error = str_make(msg.data, msg.len);
+}
+
+// unify the type found for an expression with the type its context expects
+static bool expect(typechecker_t *tc, type_t *expected, type_t *found) {
+  if (unify(expected, found)) {
+    return true;
+  }
+  bytes_t msg = bytes_new();
+  names_t names = {.len = 0};
+  push_cstr(&msg, "type error: expected ");
+  push_type(&msg, &names, expected);
+  push_cstr(&msg, " but got ");
+  push_type(&msg, &names, found);
+  set_error(tc, msg);
+  return false;
+}
+
+// restrict a type to the kinds of operands an operator is defined on
+static bool expect_kinds(typechecker_t *tc, type_t *t, u8 kinds,
+                         const char *op) {
+  t = find(t);
+  if (t->kind == TY_VAR && (t->kinds & kinds) != 0) {
+    t->kinds &= kinds;
+    return true;
+  } else if (t->kind != TY_VAR && (kinds & KIND(t->kind)) != 0) {
+    return true;
+  }
+  bytes_t msg = bytes_new();
+  names_t names = {.len = 0};
+  push_cstr(&msg, "type error: operator ");
+  push_cstr(&msg, op);
+  push_cstr(&msg, " is not defined on ");
+  push_type(&msg, &names, t);
+  set_error(tc, msg);
+  return false;
+}
+
+// turn the variables created below the current let level into the variables
+// of a type scheme
+static void generalize(typechecker_t *tc, type_t *t) {
+  t = find(t);
+  if (t->kind == TY_VAR && t->level > tc->level) {
+    t->level = GENERIC;
+  } else if (t->kind == TY_FUN) {
+    generalize(tc, t->param);
+    generalize(tc, t->result);
+  }
+}
+
+// generic variables of a scheme, and the fresh variables replacing them
+typedef struct subst {
+  type_t **from;
+  type_t **to;
+  usize len;
+  usize cap;
+} subst_t;
+
+static type_t *instantiate(typechecker_t *tc, subst_t *subst, type_t *t) {
+  t = find(t);
+  switch (t->kind) {
+  case TY_VAR:
+    if (t->level != GENERIC) {
+      return t;
+    }
+    for (usize i = 0; i < subst->len; ++i) {
+      if (subst->from[i] == t) {
+        return subst->to[i];
+      }
+    }
+    if (subst->len == subst->cap) {
+      subst->cap = (subst->cap == 0) ? 4 : 2 * subst->cap;
+      subst->from = gcrealloc(subst->from, subst->cap * sizeof(type_t *));
+      subst->to = gcrealloc(subst->to, subst->cap * sizeof(type_t *));
+    }
+    subst->from[subst->len] = t;
+    subst->to[subst->len] = fresh_var(tc, t->kinds);
+    return subst->to[subst->len++];
+  case TY_FUN:
+    return fun_type(instantiate(tc, subst, t->param),
+                    instantiate(tc, subst, t->result));
+  default:
+    return t;
+  }
+}
+
+// types of the bindings of a frame, laid out like the frame itself
+typedef struct tenv {
+  type_t **slots;
+  // captures of the function of the frame, as addresses in the parent frame
+  evar_t *captures;
+  struct tenv *parent;
+} tenv_t;
+
+static tenv_t *tenv_new(usize size, evar_t *captures, tenv_t *parent) {
+  tenv_t *env = gcalloc(sizeof(tenv_t));
+  env->slots = gcalloc(size * sizeof(type_t *));
+  env->captures = captures;
+  env->parent = parent;
+  return env;
+}
+
+static type_t *var_type(typechecker_t *tc, tenv_t *env, evar_t *var) {
+  switch (var->scope) {
+  case VAR_LOCAL:
+    return env->slots[var->slot];
+  case VAR_CAPTURED:
+    return var_type(tc, env->parent, &env->captures[var->slot]);
+  case VAR_GLOBAL:
+    return (var->slot < tc->nglobals) ? tc->globals[var->slot] : NULL;
+  case VAR_UNBOUND:
+    return NULL;
+  }
+  return NULL;
+}
+
+// remember an operator specialized on the type of its operands
+static void push_op(typechecker_t *tc, expr_t *e, type_t *operand) {
+  if (tc->nops == tc->ops_cap) {
+    tc->ops_cap = (tc->ops_cap == 0) ? 16 : 2 * tc->ops_cap;
+    tc->ops = gcrealloc(tc->ops, tc->ops_cap * sizeof(expr_t *));
+    tc->op_types = gcrealloc(tc->op_types, tc->ops_cap * sizeof(type_t *));
+  }
+  tc->ops[tc->nops] = e;
+  tc->op_types[tc->nops] = operand;
+  tc->nops += 1;
+}
+
+static type_t *infer(typechecker_t *tc, tenv_t *env, expr_t *e);
+
+static type_t *infer_binop(typechecker_t *tc, tenv_t *env, expr_t *e,
+                           u8 kinds, const char *op) {
+  INFER(lhs, tc, env, e->binop.lhs);
+  INFER(rhs, tc, env, e->binop.rhs);
+  if (!expect(tc, lhs, rhs) || !expect_kinds(tc, lhs, kinds, op)) {
+    return NULL;
+  }
+  return lhs;
+}
+
+// the type of a let binding, generalized over the variables it introduced
+static type_t *infer_binding(typechecker_t *tc, tenv_t *env, expr_t *e,
+                             type_t *self) {
+  tc->level += 1;
+  type_t *t = infer(tc, env, e);
+  if (t != NULL && self != NULL && !expect(tc, self, t)) {
+    t = NULL;
+  }
+  tc->level -= 1;
+  if (t != NULL) {
+    generalize(tc, t);
+  }
+  return t;
+}
+
+// a recursive binding must be a function, and is monomorphic in its own body
+static type_t *self_type(typechecker_t *tc) {
+  tc->level += 1;
+  type_t *t = fun_type(fresh_var(tc, ANY_KIND), fresh_var(tc, ANY_KIND));
+  tc->level -= 1;
+  return t;
+}
+
+static type_t *infer(typechecker_t *tc, tenv_t *env, expr_t *e) {
+  switch (e->kind) {
+  case E_NUM:
+  case E_INT:
+    return &NUM_TYPE;
+  case E_STR:
+    return &STR_TYPE;
+  case E_BOOL:
+    return &BOOL_TYPE;
+  case E_UNIT:
+    return &UNIT_TYPE;
+  case E_VAR: {
+    type_t *t = var_type(tc, env, &e->var);
+    if (t == NULL) {
+      bytes_t msg = bytes_new();
+      // globals without a type were rejected, the other bindings are unknown
+      push_cstr(&msg, (e->var.scope == VAR_GLOBAL)
+                          ? "type error: ill-typed binding "
+                          : "type error: unknown binding ");
+      for (usize i = 0; i < e->var.name.len; ++i) {
+        bytes_push(&msg, e->var.name.data[i]);
+      }
+      set_error(tc, msg);
+      return NULL;
+    }
+    subst_t subst = {.from = NULL, .to = NULL, .len = 0, .cap = 0};
+    return instantiate(tc, &subst, t);
+  }
+  case E_CALL:
+  case E_CALL_FUN: {
+    INFER(callee, tc, env, e->call.callee);
+    for (usize i = 0; i < e->call.nargs; ++i) {
+      INFER(arg, tc, env, &e->call.args[i]);
+      type_t *result = fresh_var(tc, ANY_KIND);
+      if (!expect(tc, fun_type(arg, result), callee)) {
+        return NULL;
+      }
+      callee = result;
+    }
+    return callee;
+  }
+  case E_LET: {
+    type_t *t = infer_binding(tc, env, e->let.expr, NULL);
+    if (t == NULL) {
+      return NULL;
+    }
+    env->slots[e->let.slot] = t;
+    return infer(tc, env, e->let.body);
+  }
+  case E_LETREC: {
+    type_t *self = self_type(tc);
+    env->slots[e->let.slot] = self;
+    type_t *t = infer_binding(tc, env, e->let.expr, self);
+    if (t == NULL) {
+      return NULL;
+    }
+    env->slots[e->let.slot] = t;
+    return infer(tc, env, e->let.body);
+  }
+  case E_FUN: {
+    tenv_t *inner = tenv_new(e->fun.frame_size, e->fun.captures, env);
+    for (usize i = 0; i < e->fun.arity; ++i) {
+      inner->slots[i] = fresh_var(tc, ANY_KIND);
+    }
+    INFER(t, tc, inner, e->fun.body);
+    for (usize i = e->fun.arity; i > 0; --i) {
+      t = fun_type(inner->slots[i - 1], t);
+    }
+    return t;
+  }
+  case E_IFTHEN: {
+    INFER(cond, tc, env, e->ifthen.cond);
+    if (!expect(tc, &BOOL_TYPE, cond)) {
+      return NULL;
+    }
+    INFER(then_type, tc, env, e->ifthen.then_body);
+    INFER(else_type, tc, env, e->ifthen.else_body);
+    if (!expect(tc, then_type, else_type)) {
+      return NULL;
+    }
+    return then_type;
+  }
+  case E_NEG: {
+    INFER(rhs, tc, env, e->unop.rhs);
+    if (!expect_kinds(tc, rhs, ARITH_KINDS, "-")) {
+      return NULL;
+    }
+    return rhs;
+  }
+  case E_ADD:
+  case E_ADD_NUM:
+  case E_ADD_INT:
+  case E_ADD_STR: {
+    type_t *t = infer_binop(tc, env, e, ADD_KINDS, "+");
+    if (t != NULL) {
+      push_op(tc, e, t);
+    }
+    return t;
+  }
+  case E_SUB:
+  case E_SUB_NUM:
+  case E_SUB_INT:
+    return infer_binop(tc, env, e, ARITH_KINDS, "-");
+  case E_MUL:
+  case E_MUL_NUM:
+  case E_MUL_INT:
+    return infer_binop(tc, env, e, ARITH_KINDS, "*");
+  case E_DIV:
+    return infer_binop(tc, env, e, DIV_KINDS, "/");
+  case E_EQ:
+  case E_EQ_NUM:
+  case E_EQ_INT:
+  case E_EQ_STR: {
+    type_t *t = infer_binop(tc, env, e, EQ_KINDS, "==");
+    if (t == NULL) {
+      return NULL;
+    }
+    push_op(tc, e, t);
+    return &BOOL_TYPE;
+  }
+  case E_ERROR:
+  case E_NOMATCH:
+    tc->error = STR("type error: invalid expression");
+    return NULL;
+  }
+  return NULL;
+}
+
+typechecker_t typechecker_new() {
+  return (typechecker_t){.globals = NULL,
+                         .nglobals = 0,
+                         .level = 0,
+                         .error = STR(""),
+                         .ops = NULL,
+                         .op_types = NULL,
+                         .nops = 0,
+                         .ops_cap = 0};
+}
+
+static void set_global(typechecker_t *tc, usize slot, type_t *t) {
+  if (slot >= tc->nglobals) {
+    tc->globals = gcrealloc(tc->globals, (slot + 1) * sizeof(type_t *));
+    memset(&tc->globals[tc->nglobals], 0,
+           (slot + 1 - tc->nglobals) * sizeof(type_t *));
+    tc->nglobals = slot + 1;
+  }
+  tc->globals[slot] = t;
+}
+
+// rewrite the operators whose operands turned out to be strings
+static void specialize(typechecker_t *tc) {
+  for (usize i = 0; i < tc->nops; ++i) {
+    expr_t *e = tc->ops[i];
+    if (find(tc->op_types[i])->kind != TY_STR) {
+      continue;
+    }
+    switch (e->kind) {
+    case E_ADD:
+    case E_ADD_NUM:
+    case E_ADD_INT:
+      e->kind = E_ADD_STR;
+      break;
+    case E_EQ:
+    case E_EQ_NUM:
+    case E_EQ_INT:
+      e->kind = E_EQ_STR;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+bool typecheck_toplevel(typechecker_t *tc, toplevel_t *tl) {
+  tc->level = 0;
+  tc->nops = 0;
+  tenv_t *env = tenv_new(tl->frame_size, NULL, NULL);
+  type_t *t = NULL;
+  switch (tl->kind) {
+  case TL_EXPR:
+    tc->level = 1;
+    t = infer(tc, env, &tl->expr);
+    break;
+  case TL_LET:
+    t = infer_binding(tc, env, &tl->let.expr, NULL);
+    set_global(tc, tl->let.global, t);
+    break;
+  case TL_LETREC: {
+    type_t *self = self_type(tc);
+    set_global(tc, tl->let.global, self);
+    t = infer_binding(tc, env, &tl->let.expr, self);
+    set_global(tc, tl->let.global, t);
+    break;
+  }
+  case TL_ERROR:
+    return true;
+  }
+  if (t == NULL) {
+    return false;
+  }
+  specialize(tc);
+  return true;
+}
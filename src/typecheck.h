@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ast.h"
+#include "utils.h"
+
+struct type;
+
+// types of the toplevel bindings, carried between toplevels
+typedef struct typechecker {
+  // type scheme of each global slot, NULL for bindings that were rejected
+  struct type **globals;
+  usize nglobals;
+  // nesting depth of the let bindings being inferred, for generalization
+  u32 level;
+  // first type error of the toplevel being checked
+  str_t error;
+  // operators whose operand types decide their specialization, and the type
+  // of their operands
+  expr_t **ops;
+  struct type **op_types;
+  usize nops;
+  usize ops_cap;
+} typechecker_t;
+
+typechecker_t typechecker_new();
+// Infer the types of a resolved toplevel, Hindley-Milner style, with numbers
+// (integers and floats mix), strings, booleans, unit and curried functions.
+// Let bindings are polymorphic, and operators accept the types they are
+// defined on at runtime. Return false with the error in typechecker->error for
+// an ill-typed toplevel, which is not to be evaluated. Otherwise, operators
+// proven to work on strings are rewritten into variants without type checks.
+bool typecheck_toplevel(typechecker_t *typechecker, toplevel_t *tl);
@@ -1,10 +1,21 @@
+// fileno and read, to read pipes without waiting for a full window, and mmap
+// and madvise, to map input files
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <ctype.h>
+#include <errno.h>
 #include <gc/gc.h>
 #include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "utils.h"
 
@@ -16,7 +27,9 @@ str_t str_make(u8 *data, usize len) {
 
 str_t str_from(const u8 *data, usize len) {
   u8 *buf = gcalloc_atomic(len);
-  memcpy(buf, data, len);
+  if (len != 0) {
+    memcpy(buf, data, len);
+  }
   return str_make(buf, len);
 }
 
@@ -83,6 +96,44 @@ usize bytes_fread(bytes_t *b, FILE *f) {
   return res;
 }
 
+const u8 *file_map(FILE *f, usize *len) {
+#ifdef _WIN32
+  // files are read through the windowed path
+  return NULL;
+#else
+  struct stat st;
+  i32 fd = fileno(f);
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return NULL;
+  }
+  void *data = mmap(NULL, (usize)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  // only a hint, the mapping works without it
+  madvise(data, (usize)st.st_size, MADV_SEQUENTIAL);
+  *len = (usize)st.st_size;
+  return data;
+#endif
+}
+
+usize bytes_read(bytes_t *b, FILE *f) {
+#ifdef _WIN32
+  // without read, pipes are read one full window at a time
+  return bytes_fread(b, f);
+#else
+  ssize_t res;
+  do {
+    res = read(fileno(f), b->data + b->len, b->cap - b->len);
+  } while (res < 0 && errno == EINTR);
+  if (res < 0) {
+    panic("error while reading file");
+  }
+  b->len += (usize)res;
+  return (usize)res;
+#endif
+}
+
 void fdebug_str(FILE *f, const u8 *data, usize len) {
   fputc('"', f);
   for (usize i = 0; i < len; ++i) {
@@ -60,6 +60,12 @@ void bytes_clear(bytes_t *b);
 void bytes_clear_start(bytes_t *b, usize len);
 // read the contents of a file into a vector in the available capacity
 usize bytes_fread(bytes_t *b, FILE *f);
+// map a whole regular file in memory, for reading it in sequence, and return
+// its contents, or NULL if it is empty or not a regular file
+const u8 *file_map(FILE *f, usize *len);
+// read what a file has available into the available capacity, without
+// waiting for the capacity to be filled where the platform allows it
+usize bytes_read(bytes_t *b, FILE *f);
 
 // explicit length string
 typedef struct {
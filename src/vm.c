@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "eval.h"
+#include "memo.h"
+#include "utils.h"
+#include "vm.h"
+
+// initial capacities, the stacks grow as needed
+#define VM_STACK_SIZE (1ul << 10)
+#define VM_FRAMES_SIZE (1ul << 8)
+
+#define ERROR(__msg) make_error(STR(__msg))
+#define FAIL(__msg)                                                            \
+  { return ERROR(__msg); }
+#define BUBBLE(__x)                                                            \
+  {                                                                            \
+    if (is_error(__x)) {                                                       \
+      return __x;                                                              \
+    }                                                                          \
+  }
+
+// threaded dispatch: jump directly to the code of the next instruction
+#define DISPATCH() goto *dispatch[*ip++]
+
+// make room for __n values above __top, moving the pointers into the stack
+#define RESERVE(__top, __n)                                                    \
+  {                                                                            \
+    if ((__top) + (__n) > stack_end) {                                         \
+      usize __bp = (usize)(bp - vm->stack);                                    \
+      usize __sp = (usize)(sp - vm->stack);                                    \
+      usize __args = (usize)(args - vm->stack);                                \
+      grow_stack(vm, (usize)((__top) - vm->stack) + (__n));                    \
+      bp = vm->stack + __bp;                                                   \
+      sp = vm->stack + __sp;                                                   \
+      args = vm->stack + __args;                                               \
+      stack_end = vm->stack + vm->stack_cap;                                   \
+    }                                                                          \
+  }
+
+// the callee of a frame sits just below its base, followed by its arguments
+typedef struct callframe {
+  const u32 *ip;
+  // offset of the frame in the value stack, which moves when it grows
+  usize bp;
+  vfun_t *closure;
+  chunk_t *chunk;
+  // arguments left over by an over-saturated call, applied to the result when
+  // the callee returns
+  value_t *extra;
+  usize nextra;
+  bool tail;
+  // cache the result is stored in, for calls of memoized closures
+  memo_t memo;
+  memo_key_t key;
+} callframe_t;
+
+struct vm {
+  value_t *stack;
+  usize stack_cap;
+  callframe_t *frames;
+  usize frames_cap;
+  usize max_depth;
+};
+
+vm_t vm_new(usize max_depth) {
+  vm_t vm = gcalloc(sizeof(struct vm));
+  vm->stack = gcalloc(VM_STACK_SIZE * sizeof(value_t));
+  vm->stack_cap = VM_STACK_SIZE;
+  // the call stack grows up to max_depth frames, and never beyond
+  vm->frames_cap = (max_depth < VM_FRAMES_SIZE) ? max_depth : VM_FRAMES_SIZE;
+  vm->frames = gcalloc(vm->frames_cap * sizeof(callframe_t));
+  vm->max_depth = max_depth;
+  return vm;
+}
+
+static void grow_stack(vm_t vm, usize needed) {
+  usize new_cap = vm->stack_cap;
+  while (new_cap < needed) {
+    new_cap *= 2;
+  }
+  vm->stack = gcrealloc(vm->stack, new_cap * sizeof(value_t));
+  vm->stack_cap = new_cap;
+}
+
+// grow the call stack, unless it already holds max_depth frames
+static bool grow_frames(vm_t vm) {
+  if (vm->frames_cap >= vm->max_depth) {
+    return false;
+  }
+  usize new_cap = vm->frames_cap * 2;
+  if (new_cap > vm->max_depth) {
+    new_cap = vm->max_depth;
+  }
+  vm->frames = gcrealloc(vm->frames, new_cap * sizeof(callframe_t));
+  vm->frames_cap = new_cap;
+  return true;
+}
+
+static inline value_t capture(evar_t *var, value_t *bp, vfun_t *closure) {
+  switch (var->scope) {
+  case VAR_LOCAL:
+    return bp[var->slot];
+  case VAR_CAPTURED:
+    return closure->captures[var->slot];
+  case VAR_GLOBAL:
+    return globals[var->slot];
+  case VAR_UNBOUND:
+    break;
+  }
+  return UNIT;
+}
+
+static value_t vm_run(vm_t vm, chunk_t *chunk) {
+  static void *const dispatch[] = {
+      [OP_CONST] = &&op_const,       [OP_LOCAL] = &&op_local,
+      [OP_CAPTURED] = &&op_captured, [OP_GLOBAL] = &&op_global,
+      [OP_FUN] = &&op_fun,           [OP_STORE] = &&op_store,
+      [OP_LETREC] = &&op_letrec,     [OP_TIE] = &&op_tie,
+      [OP_CALL] = &&op_call,         [OP_TAILCALL] = &&op_tailcall,
+      [OP_RETURN] = &&op_return,     [OP_JUMP] = &&op_jump,
+      [OP_BRANCH] = &&op_branch,     [OP_NEG] = &&op_neg,
+      [OP_ADD] = &&op_add,           [OP_SUB] = &&op_sub,
+      [OP_MUL] = &&op_mul,           [OP_DIV] = &&op_div,
+      [OP_EQ] = &&op_eq,             [OP_UNBOUND] = &&op_unbound,
+      [OP_INVALID] = &&op_invalid,   [OP_HALT] = &&op_halt,
+  };
+
+  value_t *stack_end = vm->stack + vm->stack_cap;
+  callframe_t *frames_end = vm->frames + vm->frames_cap;
+  callframe_t *fp = vm->frames;
+
+  // operands of a call
+  value_t callee, result;
+  value_t *args = vm->stack;
+  usize nargs;
+  bool tail;
+
+  vfun_t *closure = NULL;
+  value_t *bp = vm->stack;
+  value_t *sp = bp;
+  const u32 *ip = chunk->code;
+  RESERVE(bp, chunk->frame_size + chunk->max_stack);
+  sp = bp + chunk->frame_size;
+  for (value_t *local = bp; local < sp; ++local) {
+    *local = UNIT;
+  }
+
+  DISPATCH();
+
+op_const:
+  *sp++ = chunk->consts[*ip++];
+  DISPATCH();
+// bindings may hold errors, which fail as soon as they are read
+op_local:
+  *sp = bp[*ip++];
+  BUBBLE(*sp);
+  ++sp;
+  DISPATCH();
+op_captured:
+  *sp = closure->captures[*ip++];
+  BUBBLE(*sp);
+  ++sp;
+  DISPATCH();
+op_global:
+  *sp = globals[*ip++];
+  BUBBLE(*sp);
+  ++sp;
+  DISPATCH();
+op_fun: {
+  efun_t *code = chunk->funs[*ip++];
+  vfun_t *fun = make_closure(code);
+  for (usize i = 0; i < code->ncaptures; ++i) {
+    fun->captures[i] = capture(&code->captures[i], bp, closure);
+  }
+  *sp++ = value_fun(fun);
+  DISPATCH();
+}
+op_store:
+  bp[*ip++] = *--sp;
+  DISPATCH();
+op_letrec: {
+  value_t fun = *--sp;
+  if (!is_function(fun)) {
+    FAIL("let rec binding can only be used with a function");
+  }
+  bp[*ip++] = fun;
+  DISPATCH();
+}
+op_tie: {
+  u32 slot = *ip++;
+  tie_knot(bp[slot], slot);
+  DISPATCH();
+}
+op_call:
+  nargs = *ip++;
+  tail = false;
+  goto call;
+op_tailcall:
+  nargs = *ip++;
+  tail = true;
+  goto call;
+call: {
+  args = sp - nargs;
+  callee = args[-1];
+  if (is_pap(callee)) {
+    vpap_t *pap = as_pap(callee);
+    RESERVE(sp, pap->nargs);
+    memmove(args + pap->nargs, args, nargs * sizeof(value_t));
+    memcpy(args, pap->args, pap->nargs * sizeof(value_t));
+    callee = value_fun(pap->fun);
+    args[-1] = callee;
+    nargs += pap->nargs;
+    sp += pap->nargs;
+  }
+  if (!is_fun(callee)) {
+    FAIL("trying to call non function");
+  }
+  efun_t *code = as_fun(callee)->code;
+  if (nargs < code->arity) {
+    result = make_pap(as_fun(callee), args, nargs);
+    sp = args - 1;
+    if (tail) {
+      goto do_return;
+    }
+    *sp++ = result;
+    DISPATCH();
+  }
+  memo_t memo = NULL;
+  memo_key_t key = {.str = {.data = NULL, .len = 0}, .hash = 0};
+  if (code->memo && memo_key(args, code->arity, &key)) {
+    memo = memo_of(as_fun(callee));
+    value_t cached;
+    if (memo_get(memo, key, &cached)) {
+      // apply the cached result to the remaining arguments, if any
+      nargs -= code->arity;
+      if (nargs == 0) {
+        result = cached;
+        sp = args - 1;
+        if (tail) {
+          goto do_return;
+        }
+        *sp++ = result;
+        DISPATCH();
+      }
+      memmove(args, args + code->arity, nargs * sizeof(value_t));
+      args[-1] = cached;
+      sp = args + nargs;
+      goto call;
+    }
+  }
+  value_t *extra = NULL;
+  usize nextra = nargs - code->arity;
+  if (nextra > 0) {
+    // call with the first arguments, and apply the result to the rest
+    extra = gcalloc(nextra * sizeof(value_t));
+    memcpy(extra, args + code->arity, nextra * sizeof(value_t));
+    sp = args + code->arity;
+  }
+  if (!tail || nextra > 0 || memo != NULL) {
+    if (fp >= frames_end) {
+      usize depth = (usize)(fp - vm->frames);
+      if (!grow_frames(vm)) {
+        FAIL("stack overflow");
+      }
+      fp = vm->frames + depth;
+      frames_end = vm->frames + vm->frames_cap;
+    }
+    *fp++ = (callframe_t){.ip = ip,
+                          .bp = (usize)(bp - vm->stack),
+                          .closure = closure,
+                          .chunk = chunk,
+                          .extra = extra,
+                          .nextra = nextra,
+                          .tail = tail,
+                          .memo = memo,
+                          .key = key};
+    bp = args;
+  } else {
+    memmove(bp, args, code->arity * sizeof(value_t));
+  }
+  closure = as_fun(callee);
+  chunk = code->chunk;
+  RESERVE(bp, chunk->frame_size + chunk->max_stack);
+  sp = bp + chunk->frame_size;
+  for (value_t *local = bp + code->arity; local < sp; ++local) {
+    *local = UNIT;
+  }
+  ip = chunk->code;
+  DISPATCH();
+}
+op_return:
+  result = sp[-1];
+  sp = bp - 1;
+  goto do_return;
+do_return:
+  fp -= 1;
+  ip = fp->ip;
+  bp = vm->stack + fp->bp;
+  closure = fp->closure;
+  chunk = fp->chunk;
+  if (fp->memo != NULL) {
+    memo_insert(fp->memo, fp->key, result);
+  }
+  if (fp->nextra > 0) {
+    *sp++ = result;
+    memcpy(sp, fp->extra, fp->nextra * sizeof(value_t));
+    sp += fp->nextra;
+    nargs = fp->nextra;
+    tail = fp->tail;
+    goto call;
+  }
+  if (fp->tail) {
+    // the frame was only kept to cache the result: keep returning
+    sp = bp - 1;
+    goto do_return;
+  }
+  *sp++ = result;
+  DISPATCH();
+op_jump:
+  ip = chunk->code + *ip;
+  DISPATCH();
+op_branch: {
+  value_t cond = *--sp;
+  if (!is_bool(cond)) {
+    FAIL("condition is not a boolean");
+  }
+  u32 target = *ip++;
+  if (!as_bool(cond)) {
+    ip = chunk->code + target;
+  }
+  DISPATCH();
+}
+op_neg:
+  sp[-1] = value_neg(sp[-1]);
+  BUBBLE(sp[-1]);
+  DISPATCH();
+op_add: {
+  value_t rhs = *--sp;
+  value_t *lhs = &sp[-1];
+  if (is_small_int(*lhs) && is_small_int(rhs)) {
+    *lhs = value_int(as_small_int(*lhs) + as_small_int(rhs));
+  } else if (is_num(*lhs) && is_num(rhs)) {
+    *lhs = value_num(as_num(*lhs) + as_num(rhs));
+  } else {
+    *lhs = value_add(*lhs, rhs);
+    BUBBLE((*lhs));
+  }
+  DISPATCH();
+}
+op_sub: {
+  value_t rhs = *--sp;
+  value_t *lhs = &sp[-1];
+  if (is_small_int(*lhs) && is_small_int(rhs)) {
+    *lhs = value_int(as_small_int(*lhs) - as_small_int(rhs));
+  } else if (is_num(*lhs) && is_num(rhs)) {
+    *lhs = value_num(as_num(*lhs) - as_num(rhs));
+  } else {
+    *lhs = value_sub(*lhs, rhs);
+    BUBBLE((*lhs));
+  }
+  DISPATCH();
+}
+op_mul: {
+  value_t rhs = *--sp;
+  value_t *lhs = &sp[-1];
+  if (is_small_int(*lhs) && is_small_int(rhs)) {
+    *lhs = int_mul(as_small_int(*lhs), as_small_int(rhs));
+  } else if (is_num(*lhs) && is_num(rhs)) {
+    *lhs = value_num(as_num(*lhs) * as_num(rhs));
+  } else {
+    *lhs = value_mul(*lhs, rhs);
+    BUBBLE((*lhs));
+  }
+  DISPATCH();
+}
+op_div: {
+  value_t rhs = *--sp;
+  sp[-1] = value_div(sp[-1], rhs);
+  BUBBLE(sp[-1]);
+  DISPATCH();
+}
+op_eq: {
+  value_t rhs = *--sp;
+  value_t *lhs = &sp[-1];
+  if (is_small_int(*lhs) && is_small_int(rhs)) {
+    *lhs = value_bool(lhs->bits == rhs.bits);
+  } else if (is_num(*lhs) && is_num(rhs)) {
+    *lhs = value_bool(as_num(*lhs) == as_num(rhs));
+  } else {
+    *lhs = value_eq(*lhs, rhs);
+    BUBBLE((*lhs));
+  }
+  DISPATCH();
+}
+op_unbound:
+  FAIL("unknown binding");
+op_invalid:
+  FAIL("invalid expression");
+op_halt:
+  return sp[-1];
+}
+
+void vm_walk_file(vm_t vm, toplevel_t *tl) {
+  switch (tl->kind) {
+  case TL_EXPR: {
+    value_t val = vm_run(vm, compile_toplevel(tl));
+    print_result(&val);
+    break;
+  }
+  case TL_LET:
+  case TL_LETREC:
+    globals_reserve(tl->let.global + 1);
+    globals[tl->let.global] = vm_run(vm, compile_toplevel(tl));
+    break;
+  case TL_ERROR:
+    break;
+  }
+}
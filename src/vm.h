@@ -0,0 +1,18 @@
+#pragma once
+
+#include "ast.h"
+#include "eval.h"
+#include "utils.h"
+
+struct vm;
+// bytecode virtual machine, with its value and call stacks
+typedef struct vm *vm_t;
+
+// default maximum number of nested non-tail calls
+#define VM_MAX_DEPTH (1ul << 20)
+
+// create a vm, whose calls fail with a stack overflow error beyond max_depth
+// nested non-tail calls
+vm_t vm_new(usize max_depth);
+// compile and run a toplevel, like walk_file
+void vm_walk_file(vm_t vm, toplevel_t *tl);